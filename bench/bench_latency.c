@@ -0,0 +1,412 @@
+//
+//  bench_latency.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+//  End-to-end latency benchmark: notes are injected into the "Keyboard"
+//  ports of the loopback backend, go through the real pump, mproc and
+//  output path, and are captured on the "Virtual Output" port. The delay
+//  between injection and capture of each message is collected into a
+//  log-linear (HDR-style) histogram. The in-process part, from the read
+//  of the input to the handler, is measured with the message timestamps.
+//
+//  With several keyboards, each burst is injected into all of them at
+//  once. They are read either by the single pump, or by one reader per
+//  port feeding a processing thread through a multi-producer ring, as
+//  miditrick --readers does.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../midio.h"
+#include "../midio_loop.h"
+#include "../mproc.h"
+#include "../mring.h"
+
+
+/*** literals ***/
+
+#define HIST_SUB_BITS   5   // 32 sub-buckets per power of two: ~3% precision
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_SIZE       ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define RING_SIZE       4096    // max messages in flight
+#define MAX_KEYBOARDS   8
+
+// ports 0 to keyboard_count - 1 are keyboards, then comes the output
+
+
+/*** types ***/
+
+enum mode {
+    MODE_IDLE,      // one message in flight at a time
+    MODE_CC,        // dense flood of control changes
+    MODE_CHORD,     // bursts of 4-note chords
+};
+
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_SIZE];
+};
+
+struct bench {
+    MIDIO *midio;
+    MPROC mproc;
+
+    enum mode mode;
+    long total;
+    int window;
+    bool dump;
+    int keyboard_count;
+    bool readers;
+    MRING *ring;        // readers to processing thread
+
+    // injection time of each message in flight, indexed by sequence number
+    uint64_t send_time[RING_SIZE];
+    long sent;
+    long received;
+
+    struct hist hist;       // injection to capture
+    struct hist proc_hist;  // read by the backend to handler
+};
+
+
+/*** functions ***/
+
+static uint64_t _now(void)
+{
+    return midio_get_time();
+}
+
+static int _hist_index(uint64_t value)
+{
+    if (value < HIST_SUB)
+        return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((value >> shift) & (HIST_SUB - 1));
+}
+
+static uint64_t _hist_bucket_max(int index)
+{
+    if (index < HIST_SUB)
+        return index;
+    int shift = index / HIST_SUB - 1;
+    uint64_t sub = index % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << shift) - 1;
+}
+
+static void _hist_add(struct hist *h, uint64_t value)
+{
+    h->buckets[_hist_index(value)]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+static uint64_t _hist_percentile(const struct hist *h, double percentile)
+{
+    uint64_t threshold = (uint64_t)(h->count * percentile / 100.0 + 0.5);
+    uint64_t cumul = 0;
+
+    if (threshold == 0)
+        threshold = 1;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        cumul += h->buckets[i];
+        if (cumul >= threshold)
+            return _hist_bucket_max(i) < h->max ? _hist_bucket_max(i) : h->max;
+    }
+    return h->max;
+}
+
+static void _hist_print(const char *name, const struct hist *h)
+{
+    printf("%s (us): p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f p99.99=%.1f max=%.1f\n",
+           name,
+           _hist_percentile(h, 50.0) / 1000.0,
+           _hist_percentile(h, 90.0) / 1000.0,
+           _hist_percentile(h, 99.0) / 1000.0,
+           _hist_percentile(h, 99.9) / 1000.0,
+           _hist_percentile(h, 99.99) / 1000.0,
+           h->max / 1000.0);
+}
+
+static void _hist_dump(const struct hist *h)
+{
+    uint64_t cumul = 0;
+
+    printf("%14s %12s %14s\n", "value (ns)", "percentile", "count");
+    for (int i = 0; i < HIST_SIZE; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        cumul += h->buckets[i];
+        printf("%14llu %12.6f %14llu\n", (unsigned long long)_hist_bucket_max(i),
+               100.0 * cumul / h->count, (unsigned long long)h->buckets[i]);
+    }
+}
+
+static void _process(struct bench *me, MIDIO_MSG *msgs, int count)
+{
+    uint64_t now = _now();
+    for (int i = 0; i < count; i++)
+        _hist_add(&me->proc_hist, now - msgs[i].time);
+    mproc_batch_handler(&me->mproc, msgs, count);
+    midio_flush(me->midio);
+}
+
+static void _batch_handler(void *ctx, MIDIO_MSG *msgs, int count)
+{
+    struct bench *me = ctx;
+    _process(me, msgs, count);
+    midio_set_pump_deadline(me->midio, mproc_get_next_time(&me->mproc));
+}
+
+static void _push_handler(void *ctx, MIDIO_MSG *msgs, int count)
+{
+    struct bench *me = ctx;
+    mring_push_batch(me->ring, msgs, count);
+}
+
+static void *_pump_thread(void *arg)
+{
+    struct bench *me = arg;
+    if (me->readers)
+        midio_start_readers(me->midio, me, _push_handler);
+    else
+        midio_start_batch_pump(me->midio, me, _batch_handler);
+    return NULL;
+}
+
+static void *_processing_thread(void *arg)
+{
+    struct bench *me = arg;
+    MIDIO_MSG msgs[MIDIO_BATCH_SIZE];
+
+    for (;;) {
+        int count = mring_pop_batch(me->ring, msgs, MIDIO_BATCH_SIZE, mproc_get_next_time(&me->mproc));
+        if (count < 0)
+            break;
+        _process(me, msgs, count);
+    }
+    return NULL;
+}
+
+static void *_capture_thread(void *arg)
+{
+    struct bench *me = arg;
+    MIDIO_PARSER parser;
+    uint8_t buf[4096];
+
+    midio_parser_init(&parser);
+
+    while (__atomic_load_n(&me->received, __ATOMIC_RELAXED) < me->total) {
+        ssize_t size = midio_loop_capture(me->keyboard_count, buf, sizeof(buf));
+        if (size <= 0) {
+            fprintf(stderr, "capture error\n");
+            exit(1);
+        }
+        uint64_t now = _now();
+
+        size_t pos = 0;
+        while (pos < (size_t)size) {
+            MIDIO_MSG msg;
+            pos += midio_parser_feed(&parser, buf + pos, size - pos, &msg);
+            if (msg.ump[0] == 0)
+                continue;
+            long seq = me->received;
+            _hist_add(&me->hist, now - me->send_time[seq % RING_SIZE]);
+            __atomic_store_n(&me->received, seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Build the next burst of messages to be injected at once. Return the
+ * number of messages stored in buf, 3 bytes each.
+ */
+static int _next_burst(struct bench *me, uint8_t *buf, long index)
+{
+    switch (me->mode) {
+        case MODE_IDLE: {
+            // note on and note off in turn, walking the keyboard
+            int note = 36 + (int)(index / 2) % 60;
+            buf[0] = 0x90;
+            buf[1] = note;
+            buf[2] = (index % 2) ? 0 : 100;
+            return 1;
+        }
+        case MODE_CC: {
+            // modulation wheel sweeps, 16 messages per write
+            for (int i = 0; i < 16; i++) {
+                buf[i * 3 + 0] = 0xB0;
+                buf[i * 3 + 1] = 0x01;
+                buf[i * 3 + 2] = (uint8_t)((index + i) & 0x7F);
+            }
+            return 16;
+        }
+        case MODE_CHORD: {
+            // major triad plus octave, pressed then released
+            static const int chord[] = {0, 4, 7, 12};
+            int root = 48 + (int)(index / 8) % 24;
+            bool on = (index / 4) % 2 == 0;
+            for (int i = 0; i < 4; i++) {
+                buf[i * 3 + 0] = 0x90;
+                buf[i * 3 + 1] = root + chord[i];
+                buf[i * 3 + 2] = on ? 100 : 0;
+            }
+            return 4;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Inject the bursts into all keyboards. Messages of a step are captured
+ * in any order, but they share their injection time.
+ */
+static void _run(struct bench *me)
+{
+    uint8_t burst[16 * 3];
+
+    while (me->sent < me->total) {
+        int count = _next_burst(me, burst, me->sent / me->keyboard_count);
+        int keyboard_count = me->keyboard_count;
+        while (keyboard_count > 1 && count * keyboard_count > me->total - me->sent)
+            keyboard_count--;
+        if (count > me->total - me->sent)
+            count = (int)(me->total - me->sent);
+
+        // wait for room in the window
+        while (me->sent + count * keyboard_count - __atomic_load_n(&me->received, __ATOMIC_ACQUIRE) > me->window)
+            ;
+
+        uint64_t now = _now();
+        for (int i = 0; i < count * keyboard_count; i++)
+            me->send_time[(me->sent + i) % RING_SIZE] = now;
+        me->sent += count * keyboard_count;
+        for (int port = 0; port < keyboard_count; port++) {
+            // a channel per keyboard, so that their notes do not collide
+            for (int i = 0; i < count; i++)
+                burst[i * 3] = (burst[i * 3] & 0xF0) | port;
+            midio_loop_inject(port, burst, count * 3);
+        }
+    }
+
+    while (__atomic_load_n(&me->received, __ATOMIC_ACQUIRE) < me->total)
+        ;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr,
+            "usage: miditrick-bench-latency [-m idle|cc|chord] [-n count] [-w window] [-k keyboards] [-r] [-d]\n"
+            "  -m  load mode (default: idle)\n"
+            "  -n  number of messages (default: 1000000)\n"
+            "  -w  max messages in flight (default: 1 for idle, 64 for cc, 8 for chord, per keyboard)\n"
+            "  -k  number of keyboards, 1 to 8 (default: 1)\n"
+            "  -r  one reader thread per keyboard, see midio_start_readers\n"
+            "  -d  dump the whole percentile distribution\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static struct bench bench;
+    struct bench *me = &bench;
+    int opt;
+
+    me->mode = MODE_IDLE;
+    me->total = 1000000;
+    me->window = 0;
+    me->keyboard_count = 1;
+
+    while ((opt = getopt(argc, argv, "m:n:w:k:rd")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (!strcmp(optarg, "idle"))
+                    me->mode = MODE_IDLE;
+                else if (!strcmp(optarg, "cc"))
+                    me->mode = MODE_CC;
+                else if (!strcmp(optarg, "chord"))
+                    me->mode = MODE_CHORD;
+                else
+                    _usage();
+                break;
+            case 'n':
+                me->total = atol(optarg);
+                break;
+            case 'w':
+                me->window = atoi(optarg);
+                break;
+            case 'k':
+                me->keyboard_count = atoi(optarg);
+                break;
+            case 'r':
+                me->readers = true;
+                break;
+            case 'd':
+                me->dump = true;
+                break;
+            default:
+                _usage();
+        }
+    }
+    if (me->keyboard_count < 1 || me->keyboard_count > MAX_KEYBOARDS)
+        _usage();
+    if (me->window == 0)
+        me->window = (me->mode == MODE_CC ? 64 : me->mode == MODE_CHORD ? 8 : 1) * me->keyboard_count;
+    if (me->window < 16 * me->keyboard_count && me->mode == MODE_CC)
+        me->window = 16 * me->keyboard_count;
+    if (me->window < 4 * me->keyboard_count && me->mode == MODE_CHORD)
+        me->window = 4 * me->keyboard_count;
+    if (me->window > RING_SIZE || me->total <= 0)
+        _usage();
+
+    static const char *names[MAX_KEYBOARDS + 1] = {
+        "Keyboard 1", "Keyboard 2", "Keyboard 3", "Keyboard 4",
+        "Keyboard 5", "Keyboard 6", "Keyboard 7", "Keyboard 8",
+    };
+    names[me->keyboard_count] = "Virtual Output";
+    midio_loop_set_ports(names, me->keyboard_count + 1);
+
+    me->midio = midio_create();
+    midio_open(me->midio);
+    mproc_init(&me->mproc, me->midio, NULL);
+
+    pthread_t pump_thread;
+    pthread_t processing_thread;
+    pthread_t capture_thread;
+    if (me->readers) {
+        me->ring = mring_create_mpsc(RING_SIZE, MRING_WAIT_BLOCK);
+        pthread_create(&processing_thread, NULL, _processing_thread, me);
+    }
+    pthread_create(&pump_thread, NULL, _pump_thread, me);
+    pthread_create(&capture_thread, NULL, _capture_thread, me);
+
+    uint64_t start = _now();
+    _run(me);
+    uint64_t elapsed = _now() - start;
+    pthread_join(capture_thread, NULL);
+
+    MIDIO_STATS stats;
+    midio_get_stats(me->midio, &stats);
+
+    static const char *mode_names[] = {"idle", "cc", "chord"};
+    printf("mode: %s, messages: %ld, window: %d, keyboards: %d, %s\n", mode_names[me->mode], me->total, me->window,
+           me->keyboard_count, me->readers ? "readers" : "pump");
+    printf("throughput: %.0f msg/s\n", me->total * 1e9 / elapsed);
+    printf("output writes: %llu for %llu messages\n",
+           (unsigned long long)stats.write_count, (unsigned long long)stats.msg_count);
+    _hist_print("latency", &me->hist);
+    _hist_print("read to handler", &me->proc_hist);
+    if (me->dump)
+        _hist_dump(&me->hist);
+
+    return 0;
+}
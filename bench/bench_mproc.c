@@ -0,0 +1,250 @@
+//
+//  bench_mproc.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+//  Microbenchmark of mproc_batch_handler: synthetic message streams are
+//  replayed in batches against a null MIDIO sink and the cost per message is reported
+//  in nanoseconds and, when hardware counters are available, instructions.
+//  Streams marked as journaled also record every message, see mjournal.h.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef LINUX
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "../midio.h"
+#include "../mproc.h"
+
+
+/*** literals ***/
+
+#define STREAM_SIZE     4096
+#define BATCH_SIZE      16      // divides STREAM_SIZE
+#define JOURNAL_SIZE    65536
+#define JOURNAL_PATH    "/tmp/miditrick-bench-XXXXXX"
+
+#define PORT_KEYBOARD   0
+#define PORT_BEATSTEP   1
+
+
+/*** types ***/
+
+struct stream {
+    const char *name;
+    void (* build)(MIDIO_MSG *msgs, int count);
+    int shift;   // initial transposition
+    bool journal;
+};
+
+
+/*** functions ***/
+
+static uint64_t _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _set(MIDIO_MSG *msg, int port, int b0, int b1, int b2)
+{
+    msg->port = port;
+    msg->ump[0] = midio_ump_midi1(b0, b1, b2);
+    msg->ump[1] = 0;
+}
+
+// note on / note off pairs walking the keyboard
+static void _build_notes(MIDIO_MSG *msgs, int count)
+{
+    for (int i = 0; i < count; i++) {
+        int note = 36 + (i / 2) % 60;
+        _set(&msgs[i], PORT_KEYBOARD, 0x90, note, (i % 2) ? 0 : 100);
+    }
+}
+
+// chord held while the left pedal (CC 0x43) goes down and up
+static void _build_pedal(MIDIO_MSG *msgs, int count)
+{
+    static const int chord[] = {60, 64, 67};  // no chord gesture
+    for (int i = 0; i < count; i++) {
+        int step = i % 8;
+        if (step < 3)
+            _set(&msgs[i], PORT_KEYBOARD, 0x90, chord[step], 100);
+        else if (step == 3)
+            _set(&msgs[i], PORT_KEYBOARD, 0xB0, 0x43, 0x7F);
+        else if (step == 4)
+            _set(&msgs[i], PORT_KEYBOARD, 0xB0, 0x43, 0x00);
+        else
+            _set(&msgs[i], PORT_KEYBOARD, 0x80, chord[step - 5], 0);
+    }
+}
+
+// BeatStep pad presses and releases, each one changing the pad colors;
+// the LED SysEx is sent later by msched at a limited rate, see
+// _led_event, so this measures the pad handling, not the LED output
+static void _build_pads(MIDIO_MSG *msgs, int count)
+{
+    for (int i = 0; i < count; i++) {
+        int pad = (i / 2) % 16;
+        _set(&msgs[i], PORT_BEATSTEP, 0x90, 0x24 + pad, (i % 2) ? 0 : 100);
+    }
+}
+
+// notes transposed out of the MIDI range, hence dropped
+static void _build_out_of_range(MIDIO_MSG *msgs, int count)
+{
+    for (int i = 0; i < count; i++) {
+        int note = 64 + (i / 2) % 60;
+        _set(&msgs[i], PORT_KEYBOARD, 0x90, note, (i % 2) ? 0 : 100);
+    }
+}
+
+#ifdef LINUX
+static int _open_instruction_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void _start_counter(int fd)
+{
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static long long _stop_counter(int fd)
+{
+    long long value = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &value, sizeof(value)) != sizeof(value))
+            value = -1;
+    }
+    return value;
+}
+#else
+static int _open_instruction_counter(void) { return -1; }
+static void _start_counter(int fd) { }
+static long long _stop_counter(int fd) { return -1; }
+#endif
+
+/**
+ * Replay a stream and report its cost to out_fd. Return false on error.
+ */
+static bool _run(const struct stream *stream, long total, int counter_fd, int out_fd)
+{
+    static MIDIO_MSG msgs[STREAM_SIZE];
+    MIDIO_MSG batch[BATCH_SIZE];
+    MPROC mproc;
+    char journal_path[] = JOURNAL_PATH;
+
+    stream->build(msgs, STREAM_SIZE);
+
+    MIDIO *midio = midio_create();
+    mproc_init(&mproc, midio, NULL);
+    mproc.shift = stream->shift;
+    if (stream->journal) {
+        int fd = mkstemp(journal_path);
+        if (fd == -1) {
+            perror("mkstemp");
+            midio_destroy(midio);
+            return false;
+        }
+        close(fd);
+        mproc.journal = mjournal_create(journal_path, JOURNAL_SIZE);
+        if (!mproc.journal) {
+            unlink(journal_path);
+            midio_destroy(midio);
+            return false;
+        }
+    }
+
+    _start_counter(counter_fd);
+    uint64_t start = _now();
+    for (long i = 0; i < total; i += BATCH_SIZE) {
+        // as the pump does, including the scheduled events; the stages
+        // modify the batch, which the pump reads anew each time
+        int count = total - i < BATCH_SIZE ? (int)(total - i) : BATCH_SIZE;
+        memcpy(batch, &msgs[i % STREAM_SIZE], count * sizeof(batch[0]));
+        mproc_batch_handler(&mproc, batch, count);
+    }
+    uint64_t elapsed = _now() - start;
+    long long instructions = _stop_counter(counter_fd);
+
+    MIDIO_STATS stats;
+    midio_get_stats(midio, &stats);
+    midio_destroy(midio);
+    if (mproc.journal) {
+        mjournal_destroy(mproc.journal);
+        unlink(journal_path);
+    }
+
+    char line[256];
+    int len;
+    if (instructions >= 0) {
+        len = snprintf(line, sizeof(line), "%-14s %10.1f ns/msg %10.1f instr/msg %8.2f out/msg\n",
+                       stream->name, (double)elapsed / total, (double)instructions / total,
+                       (double)stats.msg_count / total);
+    } else {
+        len = snprintf(line, sizeof(line), "%-14s %10.1f ns/msg %10s instr/msg %8.2f out/msg\n",
+                       stream->name, (double)elapsed / total, "n/a",
+                       (double)stats.msg_count / total);
+    }
+    if (write(out_fd, line, len) != len) {
+        perror("write");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct stream streams[] = {
+        {"notes",        _build_notes,        0,   false},
+        {"pedal",        _build_pedal,        0,   false},
+        {"beatstep",     _build_pads,         0,   false},
+        {"out-of-range", _build_out_of_range, 100, false},
+        {"notes+journal", _build_notes,       0,   true},
+    };
+    long total = argc > 1 ? atol(argv[1]) : 1000000;
+    if (total <= 0) {
+        fprintf(stderr, "usage: miditrick-bench-mproc [messages per stream]\n");
+        return 2;
+    }
+
+    // mproc prints to stdout: silence it and report on a copy of stdout
+    fflush(stdout);
+    int out_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    int counter_fd = _open_instruction_counter();
+
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        if (!_run(&streams[i], total, counter_fd, out_fd))
+            return 1;
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+//
+//  midio_null.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+//  MIDIO sink for benchmarks: no device, every output is counted and
+//  dropped. Ports are "Keyboard" (0), "BeatStep" (1) and "Virtual Output" (2).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../midio.h"
+
+
+/*** types ***/
+
+struct midio_private {
+    struct midio public;
+
+    MIDIO_STATS stats;
+};
+
+
+/*** globals ***/
+
+static const char *_port_names[] = {
+    "Keyboard",
+    "BeatStep",
+    "Virtual Output",
+};
+
+
+/*** functions ***/
+
+MIDIO *midio_create(void)
+{
+    struct midio_private *me = calloc(1, sizeof(*me));
+    return &me->public;
+}
+
+void midio_destroy(MIDIO *me)
+{
+    free(me);
+}
+
+void midio_open(MIDIO *me)
+{
+    (void)me;
+}
+
+void midio_close(MIDIO *me)
+{
+    (void)me;
+}
+
+int midio_get_port_by_name(MIDIO *me, const char *name)
+{
+    (void)me;
+    for (size_t i = 0; i < sizeof(_port_names) / sizeof(_port_names[0]); i++) {
+        if (!strcmp(_port_names[i], name))
+            return (int)i;
+    }
+    return -1;
+}
+
+bool midio_is_port_connected(MIDIO *me, int port)
+{
+    (void)me;
+    return port >= -1 && port < (int)(sizeof(_port_names) / sizeof(_port_names[0]));
+}
+
+uint32_t midio_get_disconnect_count(MIDIO *me)
+{
+    (void)me;
+    return 0;
+}
+
+int midio_start_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msg))
+{
+    (void)me;
+    (void)ctx;
+    (void)handler;
+    abort();
+}
+
+int midio_start_batch_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count))
+{
+    (void)me;
+    (void)ctx;
+    (void)handler;
+    abort();
+}
+
+int midio_start_readers(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count))
+{
+    (void)me;
+    (void)ctx;
+    (void)handler;
+    abort();
+}
+
+void midio_stop(MIDIO *me, int code)
+{
+    (void)me;
+    (void)code;
+}
+
+void midio_stop_on_signals(MIDIO *me)
+{
+    (void)me;
+}
+
+int midio_get_stop_code(MIDIO *me)
+{
+    (void)me;
+    return 0;
+}
+
+void midio_recv(MIDIO *me, MIDIO_MSG *msg)
+{
+    (void)me;
+    (void)msg;
+    abort();
+}
+
+int midio_recv_batch(MIDIO *me, MIDIO_MSG *msgs, int max_count)
+{
+    (void)me;
+    (void)msgs;
+    (void)max_count;
+    abort();
+}
+
+void midio_send(MIDIO *me, MIDIO_MSG *msg)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    (void)msg;
+    priv->stats.msg_count++;
+}
+
+void midio_send_sysex(MIDIO *me, int port, const void *data, size_t size)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    (void)port;
+    (void)data;
+    (void)size;
+    priv->stats.msg_count++;
+}
+
+void midio_flush(MIDIO *me)
+{
+    (void)me;
+}
+
+bool midio_drain(MIDIO *me, uint64_t timeout)
+{
+    (void)me;
+    (void)timeout;
+    return true;
+}
+
+uint64_t midio_get_next_send_time(MIDIO *me)
+{
+    (void)me;
+    return 0;
+}
+
+void midio_set_pump_deadline(MIDIO *me, uint64_t time)
+{
+    (void)me;
+    (void)time;
+}
+
+void midio_get_stats(MIDIO *me, MIDIO_STATS *stats)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    *stats = priv->stats;
+}
+
+void midio_set_output_limit(MIDIO *me, int port, size_t high_water, enum midio_overflow overflow)
+{
+    (void)me;
+    (void)port;
+    (void)high_water;
+    (void)overflow;
+}
+
+size_t midio_get_output_depth(MIDIO *me, int port)
+{
+    (void)me;
+    (void)port;
+    return 0;
+}
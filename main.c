@@ -1,35 +1,417 @@
 
 // http://www.gweep.net/~prefect/eng/reference/protocol/midispec.html
 
+#ifdef LINUX
+#define _GNU_SOURCE     // CPU affinity
+#endif
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <CoreFoundation/CoreFoundation.h>
+#endif
 
 #include "midio.h"
+#ifdef LINUX
+#include "midio_linux.h"
+#endif
+#include "mjournal.h"
 #include "mproc.h"
+#include "mring.h"
+#include "mrules.h"
+
+
+/*** literals ***/
+
+#define RING_SIZE               1024
+#define JOURNAL_SIZE            65536   // events kept by --journal, 2 MB
+#define SHUTDOWN_DRAIN_TIME     (3 * 1000000000ULL)    // 2048 note offs at 31250 baud, in ns
+#define PREFAULT_STACK_SIZE     (256 * 1024)
+
+
+/*** types ***/
+
+struct app {
+    MIDIO *midio;
+    MPROC mproc;
+    MRING *ring;
+    bool readers;
+    MJOURNAL *journal;
 
+    // stage timing, reported every second
+    bool profile;
+    MPROC_STAGE last_stages[MPROC_MAX_STAGES];
 
-static void _msg_handler(void *ctx, MIDIO_MSG *msg)
+    // real-time options
+    bool realtime;
+    int priority;
+    int cpu;
+};
+
+
+/*** functions ***/
+
+static void _batch_handler(void *ctx, MIDIO_MSG *msgs, int count)
+{
+    struct app *me = ctx;
+    mproc_batch_handler(&me->mproc, msgs, count);
+    midio_flush(me->midio);
+
+    // come back when the next scheduled event or message is due
+    midio_set_pump_deadline(me->midio, mproc_get_next_time(&me->mproc));
+}
+
+static void _push_handler(void *ctx, MIDIO_MSG *msgs, int count)
 {
-    MPROC *me = ctx;
-    // midio_print_msg(msg);
-    mproc_msg_handler(me, msg);
+    struct app *me = ctx;
+    mring_push_batch(me->ring, msgs, count);
+}
+
+/**
+ * Touch the stack pages the thread will use, so that they are mapped
+ * (and locked by mlockall) before the first message arrives.
+ */
+static void _prefault_stack(void)
+{
+    volatile char buf[PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < sizeof(buf); i += 4096)
+        buf[i] = 0;
+}
+
+/**
+ * Pin the calling thread to --cpu if pin is set, with or without
+ * --realtime: the receive thread is not, so that it never competes for
+ * that CPU with the processing thread at the same priority. Then apply
+ * the real-time options. Failures are reported and the thread keeps
+ * running with the default settings.
+ */
+static void _setup_thread(struct app *me, const char *name, int priority, bool pin)
+{
+#ifdef LINUX
+    if (pin && me->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(me->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+            printf("cpu: %s thread: cannot pin to CPU %d (errno=%d)\n", name, me->cpu, err);
+        else
+            printf("cpu: %s thread: pinned to CPU %d\n", name, me->cpu);
+    }
+#endif
+
+    if (!me->realtime)
+        return;
+
+    struct sched_param param = { .sched_priority = priority };
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err)
+        printf("realtime: %s thread: cannot set SCHED_FIFO priority %d (errno=%d), using default scheduling\n", name, priority, err);
+    else
+        printf("realtime: %s thread: SCHED_FIFO priority %d\n", name, priority);
+
+    _prefault_stack();
+}
+
+static void _setup_process(struct app *me)
+{
+#ifndef LINUX
+    if (me->cpu >= 0)
+        printf("cpu: CPU pinning not supported on this platform\n");
+#endif
+
+    if (!me->realtime)
+        return;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        printf("realtime: cannot lock memory (errno=%d), page faults may occur\n", errno);
+    else
+        printf("realtime: memory locked\n");
+}
+
+/**
+ * Leave once the pump is stopped, by a signal or by mproc, releasing the
+ * sounding notes and sending what is still queued first.
+ */
+static void _shutdown(struct app *me, int code)
+{
+    printf("exiting: code=%d\n", code);
+    mproc_panic(&me->mproc);
+    if (!midio_drain(me->midio, SHUTDOWN_DRAIN_TIME))
+        printf("exiting: output not fully written\n");
+    mjournal_destroy(me->journal);
+    midio_close(me->midio);
+    exit(code);
+}
+
+static void *_processing_thread(void *arg)
+{
+    struct app *me = arg;
+    MIDIO_MSG msgs[MIDIO_BATCH_SIZE];
+
+    _setup_thread(me, "processing", me->priority - 1, true);
+
+    for (;;) {
+        // wait for messages, or for the next scheduled event or message
+        uint64_t deadline = mproc_get_next_time(&me->mproc);
+        int count = mring_pop_batch(me->ring, msgs, MIDIO_BATCH_SIZE, deadline);
+        if (count < 0)
+            break;
+        mproc_batch_handler(&me->mproc, msgs, count);
+        midio_flush(me->midio);
+    }
+
+    // the receive thread has been stopped and the ring is drained
+    _shutdown(me, midio_get_stop_code(me->midio));
+    return NULL;
+}
+
+static void *_receive_thread(void *arg)
+{
+    struct app *me = arg;
+    _setup_thread(me, "receive", me->priority, false);
+    if (me->readers) {
+        // one reader per device, all pushing into the ring
+        midio_start_readers(me->midio, me, _push_handler);
+    } else {
+#ifdef LINUX
+        // receive only: the output, and waiting for it to drain, belong
+        // to the processing thread
+        MIDIO_MSG msgs[MIDIO_BATCH_SIZE];
+        for (;;) {
+            int count = midio_recv_batch(me->midio, msgs, MIDIO_BATCH_SIZE);
+            if (count < 0)
+                break;
+            mring_push_batch(me->ring, msgs, count);
+        }
+#else
+        midio_start_batch_pump(me->midio, me, _push_handler);
+#endif
+    }
+    // let the processing thread drain the ring and leave
+    mring_close(me->ring);
+    return NULL;
+}
+
+static void *_pump_thread(void *arg)
+{
+    struct app *me = arg;
+    _setup_thread(me, "pump", me->priority, true);
+    int code = midio_start_batch_pump(me->midio, me, _batch_handler);
+    _shutdown(me, code);
+    return NULL;
+}
+
+/**
+ * Report involuntary context switches and page faults of the whole
+ * process that occurred since the previous call, as they are the usual
+ * causes of audible jitter.
+ */
+static void _check_usage(struct rusage *last)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    long nivcsw = usage.ru_nivcsw - last->ru_nivcsw;
+    long minflt = usage.ru_minflt - last->ru_minflt;
+    long majflt = usage.ru_majflt - last->ru_majflt;
+    if (nivcsw || minflt || majflt) {
+        printf("realtime: %ld involuntary context switches, %ld minor and %ld major page faults\n",
+               nivcsw, minflt, majflt);
+    }
+    *last = usage;
+}
+
+/**
+ * Report the cost of each processing stage since the previous call.
+ */
+static void _print_profile(struct app *me)
+{
+    for (int i = 0; i < me->mproc.stage_count; i++) {
+        MPROC_STAGE *stage = &me->mproc.stages[i];
+        MPROC_STAGE *last = &me->last_stages[i];
+        uint64_t time = __atomic_load_n(&stage->time, __ATOMIC_RELAXED);
+        uint64_t msg_count = __atomic_load_n(&stage->msg_count, __ATOMIC_RELAXED);
+        uint64_t drop_count = __atomic_load_n(&stage->drop_count, __ATOMIC_RELAXED);
+        if (msg_count != last->msg_count) {
+            printf("profile: %-10s %8llu msgs %8.1f ns/msg %8llu dropped\n", stage->name,
+                   (unsigned long long)(msg_count - last->msg_count),
+                   (double)(time - last->time) / (msg_count - last->msg_count),
+                   (unsigned long long)(drop_count - last->drop_count));
+        }
+        last->time = time;
+        last->msg_count = msg_count;
+        last->drop_count = drop_count;
+    }
+}
+
+static void _usage(void)
+{
+    printf("usage: miditrick [--rules FILE] [--inline | --readers] [--profile] [--journal FILE [--export SMF]] [--queue BYTES] [--overflow drop|merge] [--wait spin|yield|block] [--realtime] [--priority N] [--cpu N]\n");
+    printf("  --rules     load the behavior from FILE instead of the built-in rules\n");
+    printf("  --inline    receive and process messages in the same thread\n");
+    printf("  --readers   read each device from a thread of its own\n");
+    printf("  --profile   time the processing stages and report their cost every second\n");
+    printf("  --journal   record the last messages received and sent into FILE\n");
+    printf("  --export    write the messages recorded in the --journal FILE to a Standard MIDI File and exit\n");
+    printf("  --queue     output bytes queued per device beyond which --overflow applies (default: half its share of 128 KB)\n");
+    printf("  --overflow  drop messages but note offs, or merge controller changes (default: merge)\n");
+    printf("  --wait      how the processing thread waits for messages (default: block)\n");
+    printf("  --realtime  use SCHED_FIFO, lock memory and report context switches and page faults\n");
+    printf("  --priority  SCHED_FIFO priority of the receive thread (default: 80)\n");
+    printf("  --cpu       pin the processing thread to the given CPU, ideally an isolated one\n");
+    exit(1);
 }
 
 int main(int argc, char **argv)
 {
-    MPROC mproc;
+    static struct app app;
+    static MRULES rules;
+    const char *rules_path = NULL;
+    const char *journal_path = NULL;
+    const char *smf_path = NULL;
+    bool inline_mode = false;
+    enum mring_wait wait = MRING_WAIT_BLOCK;
+    size_t high_water = 0;
+    enum midio_overflow overflow = MIDIO_OVERFLOW_MERGE;
+
+    app.priority = 80;
+    app.cpu = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--rules") && i + 1 < argc) {
+            rules_path = argv[++i];
+        } else if (!strcmp(argv[i], "--inline")) {
+            inline_mode = true;
+        } else if (!strcmp(argv[i], "--readers")) {
+            app.readers = true;
+        } else if (!strcmp(argv[i], "--profile")) {
+            app.profile = true;
+        } else if (!strcmp(argv[i], "--journal") && i + 1 < argc) {
+            journal_path = argv[++i];
+        } else if (!strcmp(argv[i], "--export") && i + 1 < argc) {
+            smf_path = argv[++i];
+        } else if (!strcmp(argv[i], "--queue") && i + 1 < argc) {
+            high_water = (size_t)atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--overflow") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "drop"))
+                overflow = MIDIO_OVERFLOW_DROP;
+            else if (!strcmp(argv[i], "merge"))
+                overflow = MIDIO_OVERFLOW_MERGE;
+            else
+                _usage();
+        } else if (!strcmp(argv[i], "--wait") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "spin"))
+                wait = MRING_WAIT_SPIN;
+            else if (!strcmp(argv[i], "yield"))
+                wait = MRING_WAIT_YIELD;
+            else if (!strcmp(argv[i], "block"))
+                wait = MRING_WAIT_BLOCK;
+            else
+                _usage();
+        } else if (!strcmp(argv[i], "--realtime")) {
+            app.realtime = true;
+        } else if (!strcmp(argv[i], "--priority") && i + 1 < argc) {
+            app.priority = atoi(argv[++i]);
+            if (app.priority < 2 || app.priority > 99)
+                _usage();
+        } else if (!strcmp(argv[i], "--cpu") && i + 1 < argc) {
+            app.cpu = atoi(argv[++i]);
+        } else {
+            _usage();
+        }
+    }
+    if ((inline_mode && app.readers) || (smf_path && !journal_path))
+        _usage();
+    if (smf_path)
+        exit(mjournal_export(journal_path, smf_path) == -1 ? 1 : 0);
+
+    // rule errors are reported before any device is opened
+    if (!rules_path)
+        mrules_init(&rules);
+    else if (mrules_load(&rules, rules_path) == -1)
+        exit(1);
+
+    if (journal_path) {
+        app.journal = mjournal_create(journal_path, JOURNAL_SIZE);
+        if (!app.journal)
+            exit(1);
+    }
+
+    // after the journal is mapped, so that it is locked as well
+    _setup_process(&app);
+
+    app.midio = midio_create();
+#ifdef LINUX
+    // input devices are only taken when named by the rules
+    for (int i = 0; i < rules.pedal_count; i++)
+        midio_linux_add_pedal(app.midio, rules.pedals[i]);
+#endif
+    midio_open(app.midio);
+    midio_set_output_limit(app.midio, -1, high_water, overflow);
 
-    MIDIO *midio = midio_create();
-    midio_open(midio);
+    // before creating threads, so that they all block the signals
+    midio_stop_on_signals(app.midio);
 
-    mproc_init(&mproc, midio);
+    mproc_init(&app.mproc, app.midio, &rules);
+    app.mproc.stage_timing = app.profile;
+    app.mproc.journal = app.journal;
 
-    midio_start_pump(midio, &mproc, _msg_handler);
+    pthread_t thread;
+    if (inline_mode) {
+        pthread_create(&thread, NULL, _pump_thread, &app);
+    } else {
+        // the receive thread, or the readers, only drain devices into
+        // the ring, so that a slow processing step never delays input
+        app.ring = app.readers ? mring_create_mpsc(RING_SIZE, wait) : mring_create(RING_SIZE, wait);
+        pthread_create(&thread, NULL, _processing_thread, &app);
+        pthread_create(&thread, NULL, _receive_thread, &app);
+    }
 
-    for (;;)
-        sleep(1000);
+    uint64_t overrun_count = 0;
+    MIDIO_STATS last_stats = {0};
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    for (;;) {
+#ifdef __APPLE__
+        // CoreMIDI reports devices plugged and unplugged on this run loop
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, false);
+#else
+        sleep(1);
+#endif
+        if (app.ring) {
+            MRING_STATS stats;
+            mring_get_stats(app.ring, &stats);
+            if (stats.overrun_count != overrun_count) {
+                printf("WARNING: %llu messages lost (ring overrun), max depth %d\n",
+                       (unsigned long long)(stats.overrun_count - overrun_count), stats.max_depth);
+                overrun_count = stats.overrun_count;
+            }
+        }
+        MIDIO_STATS stats;
+        midio_get_stats(app.midio, &stats);
+        if (stats.drop_count != last_stats.drop_count || stats.merge_count != last_stats.merge_count) {
+            printf("WARNING: output: %llu messages dropped, %llu merged, %zu bytes queued, max %zu\n",
+                   (unsigned long long)(stats.drop_count - last_stats.drop_count),
+                   (unsigned long long)(stats.merge_count - last_stats.merge_count),
+                   midio_get_output_depth(app.midio, -1), stats.max_depth);
+        }
+        last_stats = stats;
+        if (app.realtime)
+            _check_usage(&usage);
+        if (app.profile)
+            _print_profile(&app);
+    }
 
     return 0;
 }
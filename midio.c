@@ -7,15 +7,191 @@
 //
 
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 #include "midio.h"
 
 
+/*** functions ***/
+
+static int _data_size(uint8_t status)
+{
+    switch (status >> 4) {
+        case 0x8:
+        case 0x9:
+        case 0xA:
+        case 0xB:
+        case 0xE:
+            return 2;
+        case 0xC:
+        case 0xD:
+            return 1;
+        default:
+            break;
+    }
+    switch (status) {
+        case 0xF1:  // MTC quarter frame
+        case 0xF3:  // song select
+            return 1;
+        case 0xF2:  // song position pointer
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Return the current monotonic time in ns. This is the time base of
+ * MIDIO_MSG.time: received messages are stamped with it, and messages
+ * sent with a time in the future are scheduled accordingly.
+ */
+uint64_t midio_get_time(void)
+{
+#ifdef __APPLE__
+    // same clock as CoreMIDI timestamps
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    uint64_t t = mach_absolute_time();
+    return t / timebase.denom * timebase.numer + t % timebase.denom * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 void midio_print_msg(MIDIO_MSG *msg)
 {
-    if (msg->size == 2)
-        printf("%d: %02X %02X\n", msg->port, msg->bytes[0] & 0xFF, msg->bytes[1] & 0xFF);
-    else if (msg->size == 3)
-        printf("%d: %02X %02X %02X\n", msg->port, msg->bytes[0] & 0xFF, msg->bytes[1] & 0xFF, msg->bytes[2] & 0xFF);
+    if (midio_msg_words(msg) >= 2)
+        printf("%d: %08X %08X\n", msg->port, msg->ump[0], msg->ump[1]);
     else
-        printf("%d: ?\n", msg->port);
+        printf("%d: %08X\n", msg->port, msg->ump[0]);
+}
+
+void midio_parser_init(MIDIO_PARSER *me)
+{
+    memset(me, 0, sizeof(*me));
+}
+
+/**
+ * Consume bytes from data until a complete message is found or all bytes
+ * are consumed. Return the number of bytes consumed. When a message is
+ * complete, it is stored in msg as a MIDI 1.0 or system UMP, so that
+ * msg->ump[0] is not null; otherwise msg->ump[0] is set to 0 and the
+ * parser keeps the partial message for the next call. msg->port is left
+ * untouched.
+ */
+size_t midio_parser_feed(MIDIO_PARSER *me, const uint8_t *data, size_t size, MIDIO_MSG *msg)
+{
+    size_t i = 0;
+
+    msg->ump[0] = 0;
+    msg->ump[1] = 0;
+
+    while (i < size) {
+        uint8_t byte = data[i++];
+
+        if (byte >= 0xF8) {
+            // real-time message: may appear anywhere, even inside SysEx,
+            // and does not affect running status
+            msg->ump[0] = midio_ump_midi1(byte, 0, 0);
+            return i;
+        }
+
+        if (byte & 0x80) {
+            // status byte: terminates any pending SysEx or partial message
+            me->sysex = (byte == 0xF0);
+            me->count = 0;
+            if (byte >= 0xF0) {
+                // system common messages cancel running status
+                me->status = 0;
+                me->expected = _data_size(byte);
+                if (byte == 0xF6) {
+                    // tune request: no data byte
+                    msg->ump[0] = midio_ump_midi1(byte, 0, 0);
+                    return i;
+                }
+                if (me->expected)
+                    me->status = byte;
+            } else {
+                me->status = byte;
+                me->expected = _data_size(byte);
+            }
+            continue;
+        }
+
+        // data byte
+        if (me->sysex || me->status == 0)
+            continue;  // SysEx content or orphan data byte: skip it
+        me->data[me->count++] = byte;
+        if (me->count == me->expected) {
+            msg->ump[0] = midio_ump_midi1(me->status, me->data[0], me->count == 2 ? me->data[1] : 0);
+            me->count = 0;
+            if (me->status >= 0xF0)
+                me->status = 0;  // no running status for system common
+            return i;
+        }
+    }
+
+    return i;
+}
+
+/**
+ * Store the MIDI 1.0 bytes of a message into bytes, at least 3 of them,
+ * and return their number, 0 if the message has none. MIDI 2.0 channel
+ * voice messages are scaled down by dropping their low bits, a note on
+ * keeping a velocity of at least 1; program changes lose their bank,
+ * and per-note and registered controllers, having no MIDI 1.0 message
+ * of their own, are not converted.
+ */
+int midio_msg_to_bytes(const MIDIO_MSG *msg, uint8_t *bytes)
+{
+    uint8_t status = midio_msg_status(msg);
+    uint32_t value = msg->ump[1];
+
+    bytes[0] = status;
+    bytes[1] = midio_msg_index(msg);
+    switch (midio_msg_type(msg)) {
+        case MIDIO_UMP_SYSTEM:
+        case MIDIO_UMP_MIDI1:
+            if (status < 0x80)
+                return 0;
+            bytes[2] = msg->ump[0] & 0x7F;
+            return 1 + _data_size(status);
+        case MIDIO_UMP_MIDI2:
+            break;
+        default:
+            return 0;
+    }
+
+    switch (status >> 4) {
+        case 0x8:
+            bytes[2] = value >> 25;
+            return 3;
+        case 0x9:
+            bytes[2] = value >> 25;
+            if (bytes[2] == 0)
+                bytes[2] = 1;
+            return 3;
+        case 0xA:
+        case 0xB:
+            bytes[2] = value >> 25;
+            return 3;
+        case 0xC:
+            bytes[1] = value >> 24 & 0x7F;
+            return 2;
+        case 0xD:
+            bytes[1] = value >> 25;
+            return 2;
+        case 0xE:
+            bytes[1] = value >> 18 & 0x7F;
+            bytes[2] = value >> 25;
+            return 3;
+        default:
+            return 0;
+    }
 }
@@ -10,25 +10,84 @@
 #define _MIDIO_H_
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+
+/*** literals ***/
+
+#define MIDIO_BATCH_SIZE    64   // messages delivered per batch by the pump
+#define MIDIO_TIME_NOW      0    // send time meaning "as soon as possible"
+
+// UMP message types, bits 31..28 of the first word
+#define MIDIO_UMP_SYSTEM    0x1  // system real-time and common, 32 bits
+#define MIDIO_UMP_MIDI1     0x2  // MIDI 1.0 channel voice, 32 bits
+#define MIDIO_UMP_MIDI2     0x4  // MIDI 2.0 channel voice, 64 bits
 
 
 /*** types ***/
 
 typedef struct midio MIDIO;
 typedef struct midio_msg MIDIO_MSG;
+typedef struct midio_parser MIDIO_PARSER;
+typedef struct midio_stats MIDIO_STATS;
+
+/**
+ * What happens to output queued for a port holding more bytes than its
+ * high-water mark, see midio_set_output_limit. In any case, a message
+ * not fitting in the output pool is dropped.
+ */
+enum midio_overflow {
+    MIDIO_OVERFLOW_QUEUE,   // queue anyway
+    MIDIO_OVERFLOW_DROP,    // drop, except note offs and channel mode messages
+    MIDIO_OVERFLOW_MERGE,   // controllers, pressure and pitch bend update the value still queued
+};
 
+/**
+ * A message is a Universal MIDI Packet of one or two words, the first
+ * one being 0 if there is no message. Channel voice messages share the
+ * layout of the first word whatever their protocol: message type,
+ * group, status, note or controller index. The value is in the first
+ * word for MIDI 1.0 and in the second one for MIDI 2.0, with 16-bit
+ * velocities and 32-bit controllers, see the midio_msg_ accessors.
+ */
 struct midio_msg {
+    uint64_t time; // monotonic time in ns, see midio_get_time
     int port; // -1 == all ports
-    int size;
-    union {
-        char bytes[3];
-        uint8_t u8[3];
-    };
+    uint32_t ump[2];
 };
 
 struct midio {
 };
 
+/**
+ * Output counters. Each message queued for a port would have cost one
+ * write without coalescing; msg_count - write_count is the number of
+ * system calls saved.
+ */
+struct midio_stats {
+    uint64_t msg_count;    // messages queued for output, per port
+    uint64_t write_count;  // system calls issued to write them
+    uint64_t block_count;  // writes stopped because the device was full
+    uint64_t drop_count;   // messages dropped because the output queue was full or over its limit
+    uint64_t merge_count;  // messages merged into a queued one, see MIDIO_OVERFLOW_MERGE
+    size_t max_depth;      // highest number of bytes queued for a port
+};
+
+/**
+ * Streaming parser turning a raw MIDI 1.0 byte stream into messages.
+ * It handles running status, real-time bytes (0xF8..0xFF) interleaved
+ * anywhere in the stream, and SysEx, whose content is skipped so that
+ * its data bytes are never taken for channel messages.
+ */
+struct midio_parser {
+    uint8_t status;    // running status, 0 if none
+    uint8_t data[2];   // data bytes received so far
+    int count;         // number of data bytes received so far
+    int expected;      // number of data bytes expected for status
+    bool sysex;        // inside a SysEx message
+};
+
 
 /*** prototypes ***/
 
@@ -37,11 +96,118 @@ void midio_destroy(MIDIO *me);
 void midio_open(MIDIO *me);
 void midio_close(MIDIO *me);
 int midio_get_port_by_name(MIDIO *me, const char *name);
-void midio_start_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msg));
+bool midio_is_port_connected(MIDIO *me, int port);
+uint32_t midio_get_disconnect_count(MIDIO *me);
+int midio_start_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msg));
+int midio_start_batch_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count));
+int midio_start_readers(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count));
+void midio_stop(MIDIO *me, int code);
+void midio_stop_on_signals(MIDIO *me);
+int midio_get_stop_code(MIDIO *me);
 void midio_recv(MIDIO *me, MIDIO_MSG *msg);
+int midio_recv_batch(MIDIO *me, MIDIO_MSG *msgs, int max_count);
 void midio_send(MIDIO *me, MIDIO_MSG *msg);
 void midio_send_sysex(MIDIO *me, int port, const void *data, size_t size);
+void midio_flush(MIDIO *me);
+bool midio_drain(MIDIO *me, uint64_t timeout);
+uint64_t midio_get_next_send_time(MIDIO *me);
+void midio_set_pump_deadline(MIDIO *me, uint64_t time);
+void midio_get_stats(MIDIO *me, MIDIO_STATS *stats);
+void midio_set_output_limit(MIDIO *me, int port, size_t high_water, enum midio_overflow overflow);
+size_t midio_get_output_depth(MIDIO *me, int port);
+uint64_t midio_get_time(void);
 void midio_print_msg(MIDIO_MSG *msg);
+void midio_parser_init(MIDIO_PARSER *me);
+size_t midio_parser_feed(MIDIO_PARSER *me, const uint8_t *data, size_t size, MIDIO_MSG *msg);
+int midio_msg_to_bytes(const MIDIO_MSG *msg, uint8_t *bytes);
+
+/**
+ * Return the first word of a MIDI 1.0 message, status 0x80 to 0xFF, in
+ * group 0.
+ */
+static inline uint32_t midio_ump_midi1(uint8_t status, uint8_t data1, uint8_t data2)
+{
+    uint32_t type = status >= 0xF0 ? MIDIO_UMP_SYSTEM : MIDIO_UMP_MIDI1;
+    return type << 28 | (uint32_t)status << 16 | (uint32_t)data1 << 8 | data2;
+}
+
+static inline int midio_msg_type(const MIDIO_MSG *msg)
+{
+    return msg->ump[0] >> 28;
+}
+
+/**
+ * Return the number of words of a packet of the message type, 1 to 4,
+ * reserved types included. A MIDIO_MSG only holds the first two: larger
+ * packets (SysEx 8, mixed data set, flex data, stream) are not supported.
+ */
+static inline int midio_msg_words(const MIDIO_MSG *msg)
+{
+    static const uint8_t words[16] = { 1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4 };
+    return words[midio_msg_type(msg)];
+}
+
+static inline uint8_t midio_msg_status(const MIDIO_MSG *msg)
+{
+    return (uint8_t)(msg->ump[0] >> 16);
+}
+
+static inline int midio_msg_channel(const MIDIO_MSG *msg)
+{
+    return (msg->ump[0] >> 16) & 0x0F;
+}
+
+static inline void midio_msg_set_channel(MIDIO_MSG *msg, int channel)
+{
+    msg->ump[0] = (msg->ump[0] & ~0x000F0000u) | (uint32_t)(channel & 0x0F) << 16;
+}
+
+/**
+ * Note or controller number, or first data byte of a MIDI 1.0 message.
+ */
+static inline int midio_msg_index(const MIDIO_MSG *msg)
+{
+    return (msg->ump[0] >> 8) & 0x7F;
+}
+
+static inline void midio_msg_set_index(MIDIO_MSG *msg, int index)
+{
+    msg->ump[0] = (msg->ump[0] & ~0x00007F00u) | (uint32_t)(index & 0x7F) << 8;
+}
+
+/**
+ * Return the velocity of a note or the value of a controller, program,
+ * pressure or pitch bend, at the resolution of the protocol: 7 bits, 14
+ * for pitch bend, in MIDI 1.0, 16-bit velocities and 32-bit values in
+ * MIDI 2.0. Only a comparison with 0 does not depend on it.
+ */
+static inline uint32_t midio_msg_value(const MIDIO_MSG *msg)
+{
+    int command = midio_msg_status(msg) >> 4;
+    if (midio_msg_type(msg) == MIDIO_UMP_MIDI2) {
+        if (command == 0x8 || command == 0x9)
+            return msg->ump[1] >> 16;
+        if (command == 0xC)
+            return msg->ump[1] >> 24 & 0x7F;
+        return msg->ump[1];
+    }
+    if (command == 0xC || command == 0xD)
+        return midio_msg_index(msg);
+    if (command == 0xE)
+        return (msg->ump[0] & 0x7F) << 7 | midio_msg_index(msg);
+    return msg->ump[0] & 0x7F;
+}
+
+/**
+ * Tell whether the message is a note on, a MIDI 1.0 one with a velocity
+ * of 0 being a note off. In MIDI 2.0, a note on has no such meaning.
+ */
+static inline bool midio_msg_is_note_on(const MIDIO_MSG *msg)
+{
+    if ((midio_msg_status(msg) >> 4) != 0x9)
+        return false;
+    return midio_msg_type(msg) == MIDIO_UMP_MIDI2 || (msg->ump[0] & 0x7F) != 0;
+}
 
 
 #endif
@@ -7,8 +7,12 @@
 //
 
 #include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
 #include "midio.h"
 #include <CoreMIDI/CoreMIDI.h>
+#include <mach/mach_time.h>
+#include <dispatch/dispatch.h>
 
 
 /*** literals ***/
@@ -16,6 +20,11 @@
 #define _FATAL(format, ...) \
     do { _fatal("midio: fatal error (%s:%d): " format, __FILE__, __LINE__, ##__VA_ARGS__); } while(0)
 
+// ports are allocated once: CoreMIDI keeps pointers to them
+#define MIDIO_MAX_PORTS 64
+
+#define RECV_QUEUE_SIZE 1024    // messages waiting for midio_recv_batch
+
 
 /*** types ***/
 
@@ -33,6 +42,7 @@ struct midio_port {
     // physical or virtual input
     MIDIEndpointRef inputEndpoint;
     MIDIPortRef inputPort;
+    bool input_connected;
 
     // physical output
     MIDIEndpointRef outputEndpoint;
@@ -46,13 +56,36 @@ struct midio_private {
     struct midio public;
 
     void (* recv_handler)(void *ctx, MIDIO_MSG *msg);
+    void (* recv_batch_handler)(void *ctx, MIDIO_MSG *msgs, int count);
     void *recv_handler_ctx;
 
+    // the batch handler is called by CoreMIDI and by deadline_source,
+    // one at a time
+    pthread_mutex_t pump_mutex;
+    dispatch_source_t deadline_source;
+
     struct midio_port *ports;
     int port_count;
+    bool started;
+    uint32_t disconnect_count;
+
+    // the pump runs on CoreMIDI threads, the caller waits for midio_stop
+    pthread_mutex_t stop_mutex;
+    pthread_cond_t stop_cond;
+    bool stopped;
+    int stop_code;
+    dispatch_source_t signal_sources[3];
+
+    // input waiting for midio_recv_batch when no pump is started,
+    // protected by stop_mutex and signaled by stop_cond
+    MIDIO_MSG recv_queue[RECV_QUEUE_SIZE];
+    int recv_head;
+    int recv_count;
 
     MIDIClientRef midiClient;
     MIDIPortRef inputPort;
+
+    MIDIO_STATS stats;
 };
 
 
@@ -67,6 +100,22 @@ static void _fatal(const char *format, ...)
     abort();
 }
 
+static uint64_t _host_time_to_ns(MIDITimeStamp host_time)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return host_time / timebase.denom * timebase.numer + host_time % timebase.denom * timebase.numer / timebase.denom;
+}
+
+static MIDITimeStamp _ns_to_host_time(uint64_t ns)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return ns / timebase.numer * timebase.denom + ns % timebase.numer * timebase.denom / timebase.numer;
+}
+
 static CFStringRef _convertCFNumberToCFString(CFNumberRef value)
 {
     CFNumberFormatterRef formatter = CFNumberFormatterCreate(kCFAllocatorDefault, NULL, kCFNumberFormatterNoStyle);
@@ -133,8 +182,11 @@ static struct midio_port *_add_port(MIDIO *me, const char *name, int device_id,
 {
     struct midio_private *priv = (struct midio_private *)me;
 
+    if (priv->port_count >= MIDIO_MAX_PORTS) {
+        printf("midio: too many ports, ignoring %s\n", name);
+        return NULL;
+    }
     priv->port_count++;
-    priv->ports = realloc(priv->ports, priv->port_count * sizeof(*priv->ports));
     struct midio_port *ret = &priv->ports[priv->port_count - 1];
     memset(ret, 0, sizeof(*ret));
     ret->midio = me;
@@ -157,8 +209,13 @@ static void _add_or_update_port(MIDIO *me, int device_id, const char *device_nam
         struct midio_port *port = priv->ports + i;
         if (port->device_id == device_id && port->entity_id == entity_id) {
             extension_count++;
-            if (port->input_endpoint_id == endpoint_id || port->output_endpoint_id == endpoint_id) {
-                // endpoint already present - do nothing
+            if (is_input && port->input_endpoint_id == endpoint_id) {
+                // endpoint already known, possibly coming back after a removal
+                port->inputEndpoint = endpoint;
+                return;
+            }
+            if (!is_input && port->output_endpoint_id == endpoint_id) {
+                port->outputEndpoint = endpoint;
                 return;
             }
             if (is_input && port->input_endpoint_id == 0) {
@@ -205,8 +262,8 @@ static void _add_or_update_port(MIDIO *me, int device_id, const char *device_nam
             strlcat(name, " - Extension ", sizeof(name));
             strlcat(name, count_str, sizeof(name));
         }
-        _add_port(me, name, device_id, entity_id, extension_count);
-        _add_or_update_port(me, device_id, device_name, entity_id, entity_name, endpoint_id, is_input, endpoint);
+        if (_add_port(me, name, device_id, entity_id, extension_count))
+            _add_or_update_port(me, device_id, device_name, entity_id, entity_name, endpoint_id, is_input, endpoint);
     }
 }
 
@@ -219,7 +276,8 @@ static void _add_virtual_output_port(MIDIO *me, const char *name, int fourcc)
 
     CFStringRef clientName = CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8);
 
-    result = MIDISourceCreateWithProtocol(priv->midiClient, clientName, kMIDIProtocol_1_0, &outputEndpoint);
+    // MIDI 2.0 event lists may carry MIDI 1.0 messages as well, see _send
+    result = MIDISourceCreateWithProtocol(priv->midiClient, clientName, kMIDIProtocol_2_0, &outputEndpoint);
     if (result != noErr)
         _FATAL("result=%d", result);
 
@@ -238,7 +296,8 @@ static void _add_virtual_output_port(MIDIO *me, const char *name, int fourcc)
         _FATAL("result=%d", result);
 
     struct midio_port *port = _add_port(me, "Virtual Output", 0, outputId, 0);
-    port->virtualOutputEndpoint = outputEndpoint;
+    if (port)
+        port->virtualOutputEndpoint = outputEndpoint;
 }
 
 static void _scan_for_physical_ports(MIDIO *me)
@@ -371,14 +430,14 @@ static void _scan_for_virtual_ports(MIDIO *me)
             }
         }
         if (index >= 0) {
+            // known source: it keeps its port, _connect_sources
+            // reconnects it if it came back
             struct midio_port *port = priv->ports + index;
-            if (port->virtualOutputEndpoint)
-                continue;
-            if (port->inputEndpoint != sourceEndpoint) {
+            if (!port->virtualOutputEndpoint && port->inputEndpoint != sourceEndpoint) {
                 port->inputEndpoint = sourceEndpoint;
-                // TODO: reconnect input (possible only once auto-detection will be implemented)
-                continue;
+                port->input_connected = false;
             }
+            continue;
         }
 
         CFStringRef entityName = NULL;
@@ -399,15 +458,98 @@ static void _scan_for_virtual_ports(MIDIO *me)
         }
 
         struct midio_port *port = _add_port(me, entity_name, 0, entityId, 0);
+        if (!port)
+            continue;
         port->input_endpoint_id = entityId;
         port->inputEndpoint = sourceEndpoint;
         port->inputPort = priv->inputPort;
     }
 }
 
+/**
+ * Forget the endpoint removed from the system. The port keeps its index
+ * and gets the endpoint back when the device is plugged again.
+ */
+static void _remove_endpoint(MIDIO *me, MIDIEndpointRef endpoint)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    for (int i = 0; i < priv->port_count; i++) {
+        struct midio_port *port = &priv->ports[i];
+        if (port->inputEndpoint == endpoint) {
+            if (port->input_connected)
+                MIDIPortDisconnectSource(port->inputPort, endpoint);
+            port->input_connected = false;
+            port->inputEndpoint = 0;
+            __atomic_add_fetch(&priv->disconnect_count, 1, __ATOMIC_RELEASE);
+            printf("midio: port %d (%s) input disconnected\n", i, port->name);
+        }
+        if (port->outputEndpoint == endpoint) {
+            port->outputEndpoint = 0;
+            __atomic_add_fetch(&priv->disconnect_count, 1, __ATOMIC_RELEASE);
+            printf("midio: port %d (%s) output disconnected\n", i, port->name);
+        }
+    }
+}
+
+static void _connect_sources(MIDIO *me);
+
+/**
+ * Keep an input message for midio_recv_batch, dropping it if the queue
+ * is full.
+ */
+static void _push_recv(struct midio_private *priv, const MIDIO_MSG *msg)
+{
+    pthread_mutex_lock(&priv->stop_mutex);
+    if (priv->recv_count < RECV_QUEUE_SIZE) {
+        priv->recv_queue[(priv->recv_head + priv->recv_count) % RECV_QUEUE_SIZE] = *msg;
+        priv->recv_count++;
+        pthread_cond_broadcast(&priv->stop_cond);
+    } else {
+        printf("midio: input: receive queue full, message dropped\n");
+    }
+    pthread_mutex_unlock(&priv->stop_mutex);
+}
+
+/**
+ * Called by CoreMIDI, on the run loop of the thread calling midio_open,
+ * when devices are added or removed.
+ */
+static void _notify(const MIDINotification *message, void *refCon)
+{
+    MIDIO *me = refCon;
+    struct midio_private *priv = (struct midio_private *)me;
+
+    switch (message->messageID) {
+        case kMIDIMsgObjectRemoved: {
+            const MIDIObjectAddRemoveNotification *notification = (const MIDIObjectAddRemoveNotification *)message;
+            if (notification->childType == kMIDIObjectType_Source || notification->childType == kMIDIObjectType_Destination)
+                _remove_endpoint(me, (MIDIEndpointRef)notification->child);
+            break;
+        }
+        case kMIDIMsgSetupChanged: {
+            // new ports are appended, known ones keep their index
+            int old_count = priv->port_count;
+            _scan_for_physical_ports(me);
+            _scan_for_virtual_ports(me);
+            for (int i = old_count; i < priv->port_count; i++)
+                printf("device %d: name=%s\n", i, priv->ports[i].name);
+            if (priv->started)
+                _connect_sources(me);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
 MIDIO *midio_create(void)
 {
     struct midio_private *me = calloc(1, sizeof(*me));
+    me->ports = calloc(MIDIO_MAX_PORTS, sizeof(*me->ports));
+    pthread_mutex_init(&me->stop_mutex, NULL);
+    pthread_cond_init(&me->stop_cond, NULL);
+    pthread_mutex_init(&me->pump_mutex, NULL);
     return &me->public;
 }
 
@@ -415,6 +557,16 @@ void midio_destroy(MIDIO *me)
 {
     struct midio_private *priv = (struct midio_private *)me;
     assert(priv->midiClient == 0);
+    for (int i = 0; i < sizeof(priv->signal_sources) / sizeof(priv->signal_sources[0]); i++) {
+        if (priv->signal_sources[i])
+            dispatch_source_cancel(priv->signal_sources[i]);
+    }
+    if (priv->deadline_source)
+        dispatch_source_cancel(priv->deadline_source);
+    pthread_mutex_destroy(&priv->pump_mutex);
+    pthread_cond_destroy(&priv->stop_cond);
+    pthread_mutex_destroy(&priv->stop_mutex);
+    free(priv->ports);
     free(me);
 }
 
@@ -425,32 +577,53 @@ void midio_open(MIDIO *me)
 
     assert(priv->midiClient == 0);
 
-    result = MIDIClientCreate(CFSTR("MIDI client GMO"), NULL, NULL, &priv->midiClient);
+    result = MIDIClientCreate(CFSTR("MIDI client GMO"), _notify, me, &priv->midiClient);
     if (result != noErr)
         _FATAL("result=%d", result);
 
-    result = MIDIInputPortCreateWithProtocol(priv->midiClient, CFSTR("Input"), kMIDIProtocol_1_0, &priv->inputPort, ^(const MIDIEventList *eventList, void *srcConnRefCon)
+    // MIDI 1.0 sources are translated by CoreMIDI, MIDI 2.0 ones keep
+    // their resolution; packets are taken as they are
+    result = MIDIInputPortCreateWithProtocol(priv->midiClient, CFSTR("Input"), kMIDIProtocol_2_0, &priv->inputPort, ^(const MIDIEventList *eventList, void *srcConnRefCon)
     {
         struct midio_port *port = srcConnRefCon;
         struct midio_private *priv = (struct midio_private *)port->midio;
 
         const MIDIEventPacket *packet = eventList->packet;
+        MIDIO_MSG msgs[MIDIO_BATCH_SIZE];
+        int count = 0;
 
         for (int i = 0; i < eventList->numPackets; i++) {
-            if (packet->wordCount >= 1 && (packet->words[0] >> 24) == 0x20) {
-                UInt32 word = packet->words[0];
+            int type = packet->wordCount >= 1 ? packet->words[0] >> 28 : 0;
+            if (type == MIDIO_UMP_SYSTEM || type == MIDIO_UMP_MIDI1 || type == MIDIO_UMP_MIDI2) {
                 MIDIO_MSG msg = {
+                    .time = packet->timeStamp ? _host_time_to_ns(packet->timeStamp) : midio_get_time(),
                     .port = port->index,
-                    .size = 3,
-                    .u8 = { word >> 16, word >> 8, word >> 0 },
+                    .ump = { packet->words[0], packet->wordCount >= 2 ? packet->words[1] : 0 },
                 };
                 if (priv->recv_handler) {
                     priv->recv_handler(priv->recv_handler_ctx, &msg);
+                } else if (priv->recv_batch_handler) {
+                    msgs[count++] = msg;
+                    if (count == MIDIO_BATCH_SIZE) {
+                        pthread_mutex_lock(&priv->pump_mutex);
+                        priv->recv_batch_handler(priv->recv_handler_ctx, msgs, count);
+                        pthread_mutex_unlock(&priv->pump_mutex);
+                        count = 0;
+                    }
+                } else {
+                    _push_recv(priv, &msg);
                 }
             }
             // move to next packet
             packet = MIDIEventPacketNext(packet);
         }
+
+        // deliver the whole event list at once
+        if (count > 0) {
+            pthread_mutex_lock(&priv->pump_mutex);
+            priv->recv_batch_handler(priv->recv_handler_ctx, msgs, count);
+            pthread_mutex_unlock(&priv->pump_mutex);
+        }
     });
 
     // TODO: move these literals outside the module
@@ -484,37 +657,173 @@ int midio_get_port_by_name(MIDIO *me, const char *name)
     return -1;
 }
 
-void midio_start_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msg))
+/**
+ * Tell whether the port has at least one endpoint left. Port -1, meaning
+ * all ports, is always connected.
+ */
+bool midio_is_port_connected(MIDIO *me, int port)
 {
     struct midio_private *priv = (struct midio_private *)me;
 
-    priv->recv_handler = handler;
-    priv->recv_handler_ctx = ctx;
+    if (port == -1)
+        return true;
+    if (port < 0 || port >= priv->port_count)
+        return false;
+    struct midio_port *p = &priv->ports[port];
+    return p->inputEndpoint || p->outputEndpoint || p->virtualOutputEndpoint;
+}
+
+uint32_t midio_get_disconnect_count(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    return __atomic_load_n(&priv->disconnect_count, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Connect the inputs not connected yet: all of them when the pump starts,
+ * then those of devices plugged afterwards.
+ */
+static void _connect_sources(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
 
     for (int i = 0; i < priv->port_count; i++) {
         struct midio_port *port = &priv->ports[i];
 
-        if (port->inputPort) {
+        if (port->inputPort && port->inputEndpoint && !port->input_connected) {
             OSStatus result = MIDIPortConnectSource(port->inputPort, port->inputEndpoint, port);
-            if (result != noErr)
-                _FATAL("result=%d", result);
+            if (result != noErr) {
+                printf("midio: cannot connect port %d (%s): result=%d\n", i, port->name, (int)result);
+                continue;
+            }
+            port->input_connected = true;
         }
     }
 }
 
+/**
+ * Wait until midio_stop is called and return its code. Messages are
+ * delivered meanwhile by CoreMIDI threads.
+ */
+static int _wait_for_stop(struct midio_private *priv)
+{
+    pthread_mutex_lock(&priv->stop_mutex);
+    while (!priv->stopped)
+        pthread_cond_wait(&priv->stop_cond, &priv->stop_mutex);
+    int code = priv->stop_code;
+    pthread_mutex_unlock(&priv->stop_mutex);
+    return code;
+}
+
+int midio_start_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msg))
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    priv->recv_handler = handler;
+    priv->recv_handler_ctx = ctx;
+    priv->started = true;
+
+    _connect_sources(me);
+    return _wait_for_stop(priv);
+}
+
+int midio_start_batch_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count))
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    priv->recv_batch_handler = handler;
+    priv->recv_handler_ctx = ctx;
+    priv->started = true;
+
+    // one-shot timer armed by midio_set_pump_deadline, calling the
+    // handler with no message, like the timerfd of the Linux pump
+    priv->deadline_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+                                                   dispatch_get_global_queue(QOS_CLASS_USER_INTERACTIVE, 0));
+    dispatch_source_set_timer(priv->deadline_source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    dispatch_source_set_event_handler(priv->deadline_source, ^{
+        MIDIO_MSG msgs[1];
+        pthread_mutex_lock(&priv->pump_mutex);
+        dispatch_source_set_timer(priv->deadline_source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        priv->recv_batch_handler(priv->recv_handler_ctx, msgs, 0);
+        pthread_mutex_unlock(&priv->pump_mutex);
+    });
+    dispatch_resume(priv->deadline_source);
+
+    _connect_sources(me);
+    return _wait_for_stop(priv);
+}
+
+/**
+ * CoreMIDI reads the sources on a thread of its own, there is no reader
+ * per port to start: this is the batch pump.
+ */
+int midio_start_readers(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count))
+{
+    return midio_start_batch_pump(me, ctx, handler);
+}
+
+/**
+ * Make the pump return the given code. May be called from any thread.
+ */
+void midio_stop(MIDIO *me, int code)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    pthread_mutex_lock(&priv->stop_mutex);
+    if (!priv->stopped) {
+        priv->stop_code = code;
+        priv->stopped = true;
+    }
+    pthread_cond_broadcast(&priv->stop_cond);
+    pthread_mutex_unlock(&priv->stop_mutex);
+}
+
+/**
+ * Stop the pump with code 0 on SIGINT, SIGTERM or SIGHUP. The signals are
+ * received by dispatch sources, not by a handler.
+ */
+void midio_stop_on_signals(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    static const int signals[] = {SIGINT, SIGTERM, SIGHUP};
+
+    for (int i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        signal(signals[i], SIG_IGN);
+        dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, signals[i], 0,
+                                                          dispatch_get_global_queue(QOS_CLASS_USER_INTERACTIVE, 0));
+        dispatch_source_set_event_handler(source, ^{
+            printf("midio: signal %d received, stopping\n", signals[i]);
+            midio_stop(me, 0);
+        });
+        dispatch_resume(source);
+        priv->signal_sources[i] = source;
+    }
+}
+
+int midio_get_stop_code(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    return priv->stop_code;
+}
+
 static void _send(struct midio_port *port, MIDIO_MSG *msg)
 {
+    struct midio_private *priv = (struct midio_private *)port->midio;
     MIDIEventList eventList;
 
-    if (msg->size == 3) {
-        eventList.protocol = kMIDIProtocol_1_0;
+    int type = midio_msg_type(msg);
+    if (type == MIDIO_UMP_SYSTEM || type == MIDIO_UMP_MIDI1 || type == MIDIO_UMP_MIDI2) {
+        // CoreMIDI translates MIDI 2.0 messages for MIDI 1.0 destinations
+        eventList.protocol = kMIDIProtocol_2_0;
         eventList.numPackets = 1;
-        eventList.packet[0].timeStamp = 0; // now
-        eventList.packet[0].wordCount = 1;
-        eventList.packet[0].words[0] = 0x20000000 |
-            (uint32_t)msg->u8[0] << 16 |
-            (uint32_t)msg->u8[1] << 8 |
-            (uint32_t)msg->u8[2] << 0;
+        // a time in the future is scheduled by CoreMIDI, anything else is sent now
+        if (msg->time != MIDIO_TIME_NOW && msg->time > midio_get_time())
+            eventList.packet[0].timeStamp = _ns_to_host_time(msg->time);
+        else
+            eventList.packet[0].timeStamp = 0; // now
+        eventList.packet[0].wordCount = midio_msg_words(msg);
+        eventList.packet[0].words[0] = msg->ump[0];
+        eventList.packet[0].words[1] = msg->ump[1];
 
         // printf("word out: 0x%08x\n", eventList.packet[0].words[0]);
     } else {
@@ -523,16 +832,20 @@ static void _send(struct midio_port *port, MIDIO_MSG *msg)
         return;
     }
 
-    if (port->outputPort) {
+    priv->stats.msg_count++;
+
+    if (port->outputPort && port->outputEndpoint) {
         OSStatus result = MIDISendEventList(port->outputPort, port->outputEndpoint, &eventList);
         if (result != noErr)
             _FATAL("result=%d", result);
+        priv->stats.write_count++;
     }
 
     if (port->virtualOutputEndpoint) {
         OSStatus result = MIDIReceivedEventList(port->virtualOutputEndpoint, &eventList);
         if (result != noErr)
             _FATAL("result=%d", result);
+        priv->stats.write_count++;
     }
 }
 
@@ -546,6 +859,9 @@ static void _send_sysex_completion(MIDISysexSendRequest *request)
 
 static void _send_sysex(struct midio_port *port, const void *data, size_t size)
 {
+    if (!port->outputEndpoint)
+        return;
+
     unsigned char *buf = calloc(1, size);
     memcpy(buf, data, size);
     MIDISysexSendRequest *req = calloc(1, sizeof(MIDISysexSendRequest));
@@ -559,9 +875,44 @@ static void _send_sysex(struct midio_port *port, const void *data, size_t size)
         _FATAL("result=%d", result);
 }
 
+/**
+ * Wait for one message. msg->ump[0] is 0 if there is none, see
+ * midio_recv_batch.
+ */
 void midio_recv(MIDIO *me, MIDIO_MSG *msg)
 {
-    _FATAL("not implemented");
+    if (midio_recv_batch(me, msg, 1) <= 0)
+        msg->ump[0] = 0;
+}
+
+/**
+ * Wait until at least one message is available, then fill msgs with up to
+ * max_count messages, in the order CoreMIDI delivered them. Return the
+ * number of messages stored in msgs, or -1 once stopped, never 0 unlike
+ * on Linux. Must not be used along with a pump.
+ */
+int midio_recv_batch(MIDIO *me, MIDIO_MSG *msgs, int max_count)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    if (!priv->started) {
+        priv->started = true;
+        _connect_sources(me);
+    }
+
+    pthread_mutex_lock(&priv->stop_mutex);
+    while (!priv->stopped && priv->recv_count == 0)
+        pthread_cond_wait(&priv->stop_cond, &priv->stop_mutex);
+    int count = -1;
+    if (!priv->stopped) {
+        count = priv->recv_count < max_count ? priv->recv_count : max_count;
+        for (int i = 0; i < count; i++)
+            msgs[i] = priv->recv_queue[(priv->recv_head + i) % RECV_QUEUE_SIZE];
+        priv->recv_head = (priv->recv_head + count) % RECV_QUEUE_SIZE;
+        priv->recv_count -= count;
+    }
+    pthread_mutex_unlock(&priv->stop_mutex);
+    return count;
 }
 
 void midio_send(MIDIO *me, MIDIO_MSG *msg)
@@ -593,3 +944,59 @@ void midio_send_sysex(MIDIO *me, int port_nb, const void *data, size_t size)
         _send_sysex(port, data, size);
     }
 }
+
+void midio_flush(MIDIO *me)
+{
+    // CoreMIDI sends event lists immediately: nothing is queued
+}
+
+bool midio_drain(MIDIO *me, uint64_t timeout)
+{
+    // CoreMIDI takes all the output at once and paces it itself
+    return true;
+}
+
+uint64_t midio_get_next_send_time(MIDIO *me)
+{
+    // messages with a time in the future are handed to CoreMIDI with
+    // their timestamp: none is held here, the pump never has to wake up
+    // for them
+    return 0;
+}
+
+/**
+ * Ask the batch pump to call its handler, with no message if none is
+ * received, at the given time, or never if 0. The handler may set the
+ * next deadline.
+ */
+void midio_set_pump_deadline(MIDIO *me, uint64_t time)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    if (!priv->deadline_source)
+        return;
+    if (time == 0) {
+        dispatch_source_set_timer(priv->deadline_source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        return;
+    }
+    uint64_t now = midio_get_time();
+    int64_t delay = time > now ? (int64_t)(time - now) : 0;
+    dispatch_source_set_timer(priv->deadline_source, dispatch_time(DISPATCH_TIME_NOW, delay), DISPATCH_TIME_FOREVER, 0);
+}
+
+void midio_get_stats(MIDIO *me, MIDIO_STATS *stats)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    *stats = priv->stats;
+}
+
+void midio_set_output_limit(MIDIO *me, int port, size_t high_water, enum midio_overflow overflow)
+{
+    // CoreMIDI queues and paces the output of each device itself
+}
+
+size_t midio_get_output_depth(MIDIO *me, int port)
+{
+    return 0;
+}
@@ -8,20 +8,190 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <string.h>
+#include <dirent.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
 #include "midio.h"
+#include "midio_linux.h"
+#ifdef MIDIO_LOOP
+#include "midio_loop.h"
+#endif
+
+
+/*** literals ***/
+
+#define MIDIO_PORT_BLOCK    16                  // ports allocated at once, never moved
+#define MIDIO_MAX_BLOCKS    256                 // up to 4096 ports
+#define MIDIO_MAX_EVENTS    64                  // epoll events handled per wake
+#define MIDIO_RX_BUF_SIZE   4096
+#define MIDIO_MAX_SCHEDULED 256
+#define MIDIO_CHUNK_SIZE    512
+#define MIDIO_CHUNK_COUNT   256                 // 128 KB of output shared by all ports
+#define MIDIO_CHUNK_RESERVE 4                   // chunks kept for each port, see _queue
+#define MIDIO_MAX_IOV       16                  // chunks written per system call
+#define MIDIO_RETRY_TIME    (1 * 1000000)       // 1 ms, in ns
+#define MIDIO_DEV_DIR       "/dev/snd"
+#define MIDIO_INPUT_DIR     "/dev/input"
+#define MIDIO_EVDEV_MAX_KEYS 8                  // more keys: a keyboard, not pedals
+#define MIDIO_MAX_PEDALS    4                   // input device names, see midio_linux_add_pedal
+#define MIDIO_MAX_NAME      48
+
+// epoll tags: port i is tagged MIDIO_TAG_PORTS + i
+#define MIDIO_TAG_TIMER     0
+#define MIDIO_TAG_DEVICES   1
+#define MIDIO_TAG_SIGNAL    2
+#define MIDIO_TAG_STOP      3
+#define MIDIO_TAG_PORTS     4
 
 
 /*** types ***/
 
+/**
+ * Piece of output queue, taken from a pool allocated once so that
+ * queuing never allocates. Bytes from start to end are still to be
+ * written.
+ */
+struct midio_chunk {
+    struct midio_chunk *next;
+    int start;
+    int end;
+    uint8_t data[MIDIO_CHUNK_SIZE];
+};
+
+/**
+ * Keys of a pedal or switch device, in code order. Key i is delivered as
+ * control change _evdev_cc[i], so that a pedal works like the MIDI one.
+ */
+struct midio_evdev {
+    int key_count;      // 0 for a MIDI port
+    uint16_t keys[MIDIO_EVDEV_MAX_KEYS];
+    bool restamp;       // not stamped with the monotonic clock, see _open_evdev_device
+};
+
+struct midio_port {
+    struct midio_private *owner;
+    int index;
+    int fd;             // kept for the port lifetime, refers to /dev/null while disconnected
+    char name[MIDIO_MAX_NAME];
+    char node[16];      // device node in MIDIO_DEV_DIR, empty if none
+    bool connected;
+    uint32_t events;    // epoll events registered for fd, 0 if none
+    struct midio_evdev evdev;
+    bool output;        // not a pedal, set before the port is published
+
+    // input stream: bytes read from fd and not yet parsed, owned by the
+    // reader thread in reader mode
+    pthread_t reader;
+    bool reader_running;
+    struct midio_port *ready_next;
+    bool ready;         // in the ready list
+    MIDIO_PARSER parser;
+    int rx_pos;
+    int rx_len;
+    uint64_t rx_time;
+    uint8_t rx_buf[MIDIO_RX_BUF_SIZE];
+
+    // output stream: bytes queued by midio_send and not yet written;
+    // ports with such bytes are linked from tx_ports
+    struct midio_port *tx_next;
+    struct midio_chunk *tx_head;
+    struct midio_chunk *tx_tail;
+    bool tx_blocked;    // the device did not take everything, wait for EPOLLOUT
+    size_t tx_depth;    // bytes queued, read by any thread
+    int tx_chunks;      // chunks taken from the pool
+    int tx_reserve;     // chunks of the pool kept for this port
+    size_t tx_high_water;   // 0 for the default, see _queue_limited
+    enum midio_overflow tx_overflow;
+};
+
 struct midio_private {
     struct midio public;
 
-    int dev_count;
-    int devs[16];
-    char names[16][32];
+    // port i is blocks[i / MIDIO_PORT_BLOCK][i % MIDIO_PORT_BLOCK]: ports
+    // never move, so that adding one does not disturb another thread
+    int port_count;
+    uint32_t disconnect_count;
+    struct midio_port *blocks[MIDIO_MAX_BLOCKS];
+
+    // ports having input bytes not parsed yet, served in turn
+    struct midio_port *ready_head;
+    struct midio_port *ready_tail;
 
-    struct pollfd pollfds[16];
+    // ports having output bytes not written yet
+    struct midio_port *tx_ports;
+
+    // epoll set: timer, device watch and ports
+    int epoll_fd;
+
+    // input devices opened as pedals, by name, the others being left to
+    // the system
+    char pedal_names[MIDIO_MAX_PEDALS][MIDIO_MAX_NAME];
+    int pedal_count;
+
+    // devices appearing and disappearing in MIDIO_DEV_DIR and MIDIO_INPUT_DIR
+    int inotify_fd;
+    int midi_wd;
+    int input_wd;
+    int null_fd;
+
+    // stop requests: signals, and midio_stop through an eventfd
+    int signal_fd;
+    int stop_fd;
+    int stop_request;
+    bool stopped;
+    int stop_code;
+
+    // timer waking up the pump at deadlines
+    int timer_fd;
+    uint64_t timer_time;
+
+    // messages sent with a time in the future, as a min-heap on time
+    int sched_count;
+    MIDIO_MSG sched[MIDIO_MAX_SCHEDULED];
+
+    // time at which the batch pump must call its handler, 0 if none
+    uint64_t pump_deadline;
+
+    // reader mode: one thread per port, see midio_start_readers
+    void *reader_ctx;
+    void (* reader_handler)(void *ctx, MIDIO_MSG *msgs, int count);
+    int reader_stop_fd;     // readable once the readers must stop
+
+    // output chunk pool
+    struct midio_chunk *chunks;
+    struct midio_chunk *free_chunks;
+    int free_count;
+    int out_port_count;     // connected ports but pedals, sharing the pool
+    int reserve_count;      // chunks of the pool kept for the ports, at most half of it
+    int reserved_free;      // free chunks kept for ports below their reserve
+
+    // time at which blocked output must be tried again, 0 if none
+    uint64_t retry_time;
+
+    // output limit of the ports added later
+    size_t high_water;
+    enum midio_overflow overflow;
+
+    MIDIO_STATS stats;
+};
+
+
+/*** globals ***/
+
+// pedals, left to right: soft (una corda), sostenuto, sustain, then
+// general purpose controllers
+static const uint8_t _evdev_cc[MIDIO_EVDEV_MAX_KEYS] = {
+    0x43, 0x42, 0x40, 0x50, 0x51, 0x52, 0x53, 0x10
 };
 
 
@@ -61,133 +231,1494 @@ static void _fatal_error(const char *format, ...)
     abort();
 }
 
+static struct midio_port *_port(struct midio_private *priv, int index)
+{
+    return &priv->blocks[index / MIDIO_PORT_BLOCK][index % MIDIO_PORT_BLOCK];
+}
+
+/**
+ * Register fd in the epoll set with the given events, or update or remove
+ * it (events = 0) if it is already registered with *registered events.
+ */
+static void _set_events(struct midio_private *priv, int fd, uint32_t tag, uint32_t *registered, uint32_t events)
+{
+    if (events == *registered)
+        return;
+
+    struct epoll_event event = { .events = events, .data.u32 = tag };
+    int op = events == 0 ? EPOLL_CTL_DEL : *registered == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(priv->epoll_fd, op, fd, &event) == -1)
+        _fatal_error("epoll_ctl error: errno=%d", errno);
+    *registered = events;
+}
+
+static void _set_port_events(struct midio_private *priv, struct midio_port *port, uint32_t events)
+{
+    _set_events(priv, port->fd, MIDIO_TAG_PORTS + port->index, &port->events, events);
+}
+
 MIDIO *midio_create(void)
 {
-    MIDIO *me = calloc(1, sizeof(*me));
-    return me;
+    struct midio_private *me = calloc(1, sizeof(*me));
+    me->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (me->epoll_fd == -1)
+        _fatal_error("epoll error: errno=%d", errno);
+    me->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (me->timer_fd == -1)
+        _fatal_error("timerfd error: errno=%d", errno);
+    uint32_t events = 0;
+    _set_events(me, me->timer_fd, MIDIO_TAG_TIMER, &events, EPOLLIN);
+    me->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (me->stop_fd == -1)
+        _fatal_error("eventfd error: errno=%d", errno);
+    events = 0;
+    _set_events(me, me->stop_fd, MIDIO_TAG_STOP, &events, EPOLLIN);
+    me->signal_fd = -1;
+    me->inotify_fd = -1;
+    me->reader_stop_fd = -1;
+    me->null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (me->null_fd == -1)
+        _fatal_error("cannot open /dev/null: errno=%d", errno);
+
+    me->chunks = calloc(MIDIO_CHUNK_COUNT, sizeof(*me->chunks));
+    if (!me->chunks)
+        _fatal_error("out of memory");
+    for (int i = 0; i < MIDIO_CHUNK_COUNT; i++)
+        me->chunks[i].next = i + 1 < MIDIO_CHUNK_COUNT ? &me->chunks[i + 1] : NULL;
+    me->free_chunks = me->chunks;
+    me->free_count = MIDIO_CHUNK_COUNT;
+    return &me->public;
 }
 
-void midio_open(MIDIO *me)
+void midio_destroy(MIDIO *me)
 {
     struct midio_private *priv = (struct midio_private *)me;
+    close(priv->timer_fd);
+    close(priv->stop_fd);
+    if (priv->signal_fd != -1)
+        close(priv->signal_fd);
+    if (priv->reader_stop_fd != -1)
+        close(priv->reader_stop_fd);
+    close(priv->null_fd);
+    close(priv->epoll_fd);
+    for (int i = 0; i < MIDIO_MAX_BLOCKS; i++)
+        free(priv->blocks[i]);
+    free(priv->chunks);
+    free(me);
+}
+
+static void _start_reader(struct midio_port *port);
+static void _join_reader(struct midio_port *port);
+
+/**
+ * Start reading a connected port: from the epoll set of the pump, or from
+ * a thread of its own in reader mode.
+ */
+static void _watch_port(struct midio_private *priv, struct midio_port *port)
+{
+    if (priv->reader_handler)
+        _start_reader(port);
+    else
+        _set_port_events(priv, port, EPOLLIN);
+}
 
-    for (int i = 0; i < 4; i++) {
-        char fn[256];
-        snprintf(fn, sizeof(fn), "/dev/snd/midiC%dD0", i);
+/**
+ * Add or reconnect a port, see midio_linux_add_port. node is the device
+ * node name, evdev the keys of a pedal device, with no key for MIDI.
+ */
+static int _add_port(struct midio_private *priv, const char *name, const char *node, int fd, const struct midio_evdev *evdev)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        _fatal_error("fcntl error: errno=%d", errno);
 
-        int fd = open(fn, O_RDWR);
-        if (fd >= 0) {
-            char id_fn[256];
-            char id[32] = {0};
+    // a device coming back gets its former index
+    for (int i = 0; i < priv->port_count; i++) {
+        struct midio_port *port = _port(priv, i);
+        if (!port->connected && !strcmp(port->name, name)) {
+            // the reader of the former device leaves on reading /dev/null
+            _join_reader(port);
 
-            snprintf(id_fn, sizeof(id_fn), "/sys/class/sound/midiC%dD0/device/id", i);
-            int id_fd = open(id_fn, O_RDONLY);
-            read(id_fd, id, sizeof(id) - 1);
-            close(id_fd);
+            // atomically replace /dev/null by the device: the output
+            // owner keeps writing to the same fd number
+            if (dup2(fd, port->fd) == -1)
+                _fatal_error("dup2 error: errno=%d", errno);
+            close(fd);
+            _strlcpy(port->node, node, sizeof(port->node));
+            port->evdev = *evdev;
+            midio_parser_init(&port->parser);
+            port->rx_pos = 0;
+            port->rx_len = 0;
+            if (port->output)
+                __atomic_add_fetch(&priv->out_port_count, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&port->connected, true, __ATOMIC_RELEASE);
+            _watch_port(priv, port);
+            printf("midio: port %d (%s) reconnected\n", i, port->name);
+            return i;
+        }
+    }
 
-            int n = (int)strlen(id);
-            for (;;) {
-                if (n == 0)
-                    break;
-                n--;
-                if (id[n] > 32)
+    int index = priv->port_count;
+    if (index >= MIDIO_PORT_BLOCK * MIDIO_MAX_BLOCKS)
+        return -1;
+    if (!priv->blocks[index / MIDIO_PORT_BLOCK]) {
+        priv->blocks[index / MIDIO_PORT_BLOCK] = calloc(MIDIO_PORT_BLOCK, sizeof(struct midio_port));
+        if (!priv->blocks[index / MIDIO_PORT_BLOCK])
+            _fatal_error("out of memory");
+    }
+
+    struct midio_port *port = _port(priv, index);
+    port->owner = priv;
+    port->index = index;
+    port->fd = fd;
+    _strlcpy(port->name, name, sizeof(port->name));
+    _strlcpy(port->node, node, sizeof(port->node));
+    port->evdev = *evdev;
+    port->output = !evdev->key_count;
+    port->connected = true;
+    port->events = 0;
+    port->ready = false;
+    midio_parser_init(&port->parser);
+    port->rx_pos = 0;
+    port->rx_len = 0;
+    port->tx_head = NULL;
+    port->tx_tail = NULL;
+    port->tx_blocked = false;
+    port->tx_depth = 0;
+    port->tx_chunks = 0;
+    port->tx_reserve = 0;
+    port->tx_high_water = priv->high_water;
+    port->tx_overflow = priv->overflow;
+    if (port->output) {
+        __atomic_add_fetch(&priv->out_port_count, 1, __ATOMIC_RELAXED);
+        if (priv->reserve_count + MIDIO_CHUNK_RESERVE <= MIDIO_CHUNK_COUNT / 2) {
+            priv->reserve_count += MIDIO_CHUNK_RESERVE;
+            port->tx_reserve = MIDIO_CHUNK_RESERVE;
+            __atomic_add_fetch(&priv->reserved_free, MIDIO_CHUNK_RESERVE, __ATOMIC_RELAXED);
+        }
+    }
+
+    // publish the port once initialized, it may be used by another thread
+    __atomic_store_n(&priv->port_count, index + 1, __ATOMIC_RELEASE);
+    _watch_port(priv, port);
+    return index;
+}
+
+/**
+ * Add a port reading from and writing to the given file descriptor,
+ * which is switched to non-blocking mode. If a disconnected port has the
+ * same name, the file descriptor takes its place and the port keeps its
+ * index. Return the port index, or -1 if no more ports can be added.
+ */
+int midio_linux_add_port(MIDIO *me, const char *name, int fd)
+{
+    static const struct midio_evdev no_evdev;
+    return _add_port((struct midio_private *)me, name, "", fd, &no_evdev);
+}
+
+/**
+ * Open input devices of the given name, as reported by EVIOCGNAME, as
+ * pedals; no other input device is opened. To be called before
+ * midio_open, so that the devices present are found.
+ */
+void midio_linux_add_pedal(MIDIO *me, const char *name)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    if (priv->pedal_count == MIDIO_MAX_PEDALS) {
+        printf("midio: too many pedal devices, %s ignored\n", name);
+        return;
+    }
+    _strlcpy(priv->pedal_names[priv->pedal_count++], name, MIDIO_MAX_NAME);
+}
+
+/**
+ * Stop reading from a port whose device is gone. The port keeps its index
+ * and its fd number, which now refers to /dev/null so that output still
+ * queued for it is discarded.
+ */
+static void _disconnect_port(struct midio_private *priv, struct midio_port *port)
+{
+    // in reader mode, the reader and the device watch may both see it
+    if (!__atomic_exchange_n(&port->connected, false, __ATOMIC_ACQ_REL))
+        return;
+    if (port->output)
+        __atomic_sub_fetch(&priv->out_port_count, 1, __ATOMIC_RELAXED);
+    _set_port_events(priv, port, 0);
+    if (dup2(priv->null_fd, port->fd) == -1)
+        _fatal_error("dup2 error: errno=%d", errno);
+    __atomic_add_fetch(&priv->disconnect_count, 1, __ATOMIC_RELEASE);
+    if (!priv->reader_handler) {
+        port->rx_pos = 0;
+        port->rx_len = 0;
+    }
+    printf("midio: port %d (%s) disconnected\n", port->index, port->name);
+}
+
+static bool _is_midi_node(const char *node)
+{
+    int card, device;
+    char end;
+    return sscanf(node, "midiC%dD%d%c", &card, &device, &end) == 2;
+}
+
+static bool _is_evdev_node(const char *node)
+{
+    int number;
+    char end;
+    return sscanf(node, "event%d%c", &number, &end) == 1;
+}
+
+/**
+ * Open the given device node, e.g. midiC1D0, and add it as a port named
+ * after its card id, followed by "-D" for device D other than 0, so that
+ * each port of a multi-port interface has a name of its own.
+ */
+static void _open_midi_device(struct midio_private *priv, const char *node)
+{
+    char fn[256];
+    snprintf(fn, sizeof(fn), MIDIO_DEV_DIR "/%s", node);
+
+    int fd = open(fn, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    char id_fn[256];
+    char id[32] = {0};
+
+    snprintf(id_fn, sizeof(id_fn), "/sys/class/sound/%s/device/id", node);
+    int id_fd = open(id_fn, O_RDONLY);
+    if (id_fd >= 0) {
+        if (read(id_fd, id, sizeof(id) - 1) < 0)
+            id[0] = 0;
+        close(id_fd);
+    }
+
+    int n = (int)strlen(id);
+    for (;;) {
+        if (n == 0)
+            break;
+        n--;
+        if (id[n] > 32)
+            break;
+        id[n] = 0;
+    }
+    char name[MIDIO_MAX_NAME];
+    int card, device;
+    if (id[0] == 0)
+        _strlcpy(name, node, sizeof(name));
+    else if (sscanf(node, "midiC%dD%d", &card, &device) == 2 && device != 0)
+        snprintf(name, sizeof(name), "%s-%d", id, device);
+    else
+        _strlcpy(name, id, sizeof(name));
+
+    printf("midio: open device %s (%s)\n", fn, name);
+
+    static const struct midio_evdev no_evdev;
+    if (_add_port(priv, name, node, fd, &no_evdev) == -1)
+        close(fd);
+}
+
+static bool _test_bit(const unsigned long *bits, int n)
+{
+    return (bits[n / (8 * sizeof(long))] >> (n % (8 * sizeof(long)))) & 1;
+}
+
+static bool _is_pedal_name(struct midio_private *priv, const char *name)
+{
+    for (int i = 0; i < priv->pedal_count; i++) {
+        if (!strcmp(priv->pedal_names[i], name))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Open the given input device node, e.g. event3, and add it as an input
+ * only port if it has been named by midio_linux_add_pedal and looks like
+ * pedals or foot switches: a few keys and no axis. The device is grabbed
+ * so that its keys do not reach other programs, and its events are
+ * timestamped with the monotonic clock.
+ */
+static void _open_evdev_device(struct midio_private *priv, const char *node)
+{
+    if (priv->pedal_count == 0)
+        return;
+
+    char fn[256];
+    snprintf(fn, sizeof(fn), MIDIO_INPUT_DIR "/%s", node);
+
+    int fd = open(fn, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    // never take the keys of a device not asked for
+    char name[MIDIO_MAX_NAME] = {0};
+    if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) < 0 || !_is_pedal_name(priv, name)) {
+        close(fd);
+        return;
+    }
+
+    unsigned long type_bits[EV_MAX / (8 * sizeof(long)) + 1] = {0};
+    unsigned long key_bits[KEY_MAX / (8 * sizeof(long)) + 1] = {0};
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(type_bits)), type_bits) == -1 ||
+        !_test_bit(type_bits, EV_KEY) || _test_bit(type_bits, EV_REL) || _test_bit(type_bits, EV_ABS) ||
+        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) == -1) {
+        close(fd);
+        return;
+    }
+
+    // keys in code order, system buttons excluded
+    struct midio_evdev evdev = { .key_count = 0 };
+    for (int code = 0; code <= KEY_MAX; code++) {
+        if (!_test_bit(key_bits, code) || code == KEY_POWER || code == KEY_SLEEP || code == KEY_WAKEUP || code == KEY_SUSPEND)
+            continue;
+        if (evdev.key_count == MIDIO_EVDEV_MAX_KEYS) {
+            evdev.key_count = 0;
+            break;
+        }
+        evdev.keys[evdev.key_count++] = (uint16_t)code;
+    }
+    if (evdev.key_count == 0) {
+        close(fd);
+        return;
+    }
+
+    // older kernels stamp events with the wall clock, which cannot be
+    // compared to midio_get_time: such events are stamped when read
+    int clock = CLOCK_MONOTONIC;
+    if (ioctl(fd, EVIOCSCLOCKID, &clock) == -1) {
+        printf("midio: %s: no monotonic timestamps (errno=%d)\n", fn, errno);
+        evdev.restamp = true;
+    }
+    if (ioctl(fd, EVIOCGRAB, 1) == -1)
+        printf("midio: cannot grab %s: errno=%d\n", fn, errno);
+
+    printf("midio: open input device %s (%s), %d keys\n", fn, name, evdev.key_count);
+
+    if (_add_port(priv, name, node, fd, &evdev) == -1)
+        close(fd);
+}
+
+#ifndef MIDIO_LOOP
+// the loopback build has no devices to scan or watch
+
+static int _midi_node_filter(const struct dirent *entry)
+{
+    return _is_midi_node(entry->d_name);
+}
+
+static int _evdev_node_filter(const struct dirent *entry)
+{
+    return _is_evdev_node(entry->d_name);
+}
+
+/**
+ * Open the devices of a directory, in name order so that port indices do
+ * not depend on the directory order.
+ */
+static void _scan_dir(struct midio_private *priv, const char *dir, int (* filter)(const struct dirent *),
+                      void (* open_device)(struct midio_private *priv, const char *node))
+{
+    struct dirent **entries;
+    int count = scandir(dir, &entries, filter, alphasort);
+    if (count == -1)
+        return;
+
+    for (int i = 0; i < count; i++) {
+        open_device(priv, entries[i]->d_name);
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+/**
+ * Open every device of every MIDI card, then the pedals.
+ */
+static void _scan_for_devices(struct midio_private *priv)
+{
+    _scan_dir(priv, MIDIO_DEV_DIR, _midi_node_filter, _open_midi_device);
+    _scan_dir(priv, MIDIO_INPUT_DIR, _evdev_node_filter, _open_evdev_device);
+}
+
+/**
+ * Watch MIDIO_DEV_DIR and MIDIO_INPUT_DIR for device nodes being created
+ * or removed. Nodes may be created before their permissions are set,
+ * hence IN_ATTRIB.
+ */
+static void _watch_devices(struct midio_private *priv)
+{
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_ATTRIB;
+
+    priv->midi_wd = -1;
+    priv->input_wd = -1;
+    priv->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (priv->inotify_fd == -1) {
+        printf("midio: inotify error (errno=%d), hot-plug disabled\n", errno);
+        return;
+    }
+    priv->midi_wd = inotify_add_watch(priv->inotify_fd, MIDIO_DEV_DIR, mask);
+    if (priv->midi_wd == -1)
+        printf("midio: cannot watch %s (errno=%d), hot-plug disabled\n", MIDIO_DEV_DIR, errno);
+    priv->input_wd = inotify_add_watch(priv->inotify_fd, MIDIO_INPUT_DIR, mask);
+    if (priv->input_wd == -1)
+        printf("midio: cannot watch %s (errno=%d), hot-plug disabled\n", MIDIO_INPUT_DIR, errno);
+
+    uint32_t events = 0;
+    _set_events(priv, priv->inotify_fd, MIDIO_TAG_DEVICES, &events, EPOLLIN);
+}
+#endif
+
+/**
+ * Add and remove ports according to the pending device watch events.
+ */
+static void _handle_device_events(struct midio_private *priv)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(priv->inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            return;
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(*event) + event->len;
+            if (event->len == 0)
+                continue;
+
+            void (* open_device)(struct midio_private *priv, const char *node);
+            if (event->wd == priv->midi_wd && _is_midi_node(event->name))
+                open_device = _open_midi_device;
+            else if (event->wd == priv->input_wd && _is_evdev_node(event->name))
+                open_device = _open_evdev_device;
+            else
+                continue;
+
+            struct midio_port *port = NULL;
+            for (int i = 0; i < priv->port_count; i++) {
+                if (__atomic_load_n(&_port(priv, i)->connected, __ATOMIC_ACQUIRE) &&
+                    !strcmp(_port(priv, i)->node, event->name)) {
+                    port = _port(priv, i);
                     break;
-                id[n] = 0;
+                }
             }
 
-            printf("midio: open device %s (%s)\n", fn, id);
-
-            priv->devs[priv->dev_count] = fd;
-            priv->pollfds[priv->dev_count].fd = fd;
-            priv->pollfds[priv->dev_count].events = POLLIN;
-            _strlcpy(priv->names[i], id, sizeof(priv->names[i]));
-            priv->dev_count++;
+            if (event->mask & IN_DELETE) {
+                if (port)
+                    _disconnect_port(priv, port);
+            } else if (!port) {
+                open_device(priv, event->name);
+            }
         }
     }
 }
 
+void midio_open(MIDIO *me)
+{
+#ifdef MIDIO_LOOP
+    midio_loop_open(me);
+#else
+    struct midio_private *priv = (struct midio_private *)me;
+
+    // watch first so that no device plugged during the scan is missed
+    _watch_devices(priv);
+    _scan_for_devices(priv);
+#endif
+}
+
+static void _drop_queue(struct midio_private *priv, struct midio_port *port);
+
 void midio_close(MIDIO *me)
 {
     struct midio_private *priv = (struct midio_private *)me;
 
-    for (int i = 0; i < priv->dev_count; i++)
-        close(priv->devs[i]);
-    priv->dev_count = 0;
+    // closing the fds also removes them from the epoll set
+    for (int i = 0; i < priv->port_count; i++) {
+        _drop_queue(priv, _port(priv, i));
+        close(_port(priv, i)->fd);
+    }
+    priv->port_count = 0;
+    priv->ready_head = NULL;
+    priv->ready_tail = NULL;
+    priv->tx_ports = NULL;
+    priv->retry_time = 0;
+
+    if (priv->inotify_fd != -1) {
+        close(priv->inotify_fd);
+        priv->inotify_fd = -1;
+    }
 }
 
 int midio_get_port_by_name(MIDIO *me, const char *name)
 {
     struct midio_private *priv = (struct midio_private *)me;
 
-    for (int i = 0; i < priv->dev_count; i++) {
-        if (!strcmp(priv->names[i], name))
+    for (int i = 0; i < priv->port_count; i++) {
+        if (!strcmp(_port(priv, i)->name, name))
             return i;
     }
     return -1;
 }
 
-void midio_start_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msg))
+/**
+ * Tell whether the device behind a port is present. Port -1, meaning all
+ * ports, is always connected. May be called from any thread.
+ */
+bool midio_is_port_connected(MIDIO *me, int port)
 {
-    MIDIO_MSG msg;
+    struct midio_private *priv = (struct midio_private *)me;
+
+    if (port == -1)
+        return true;
+    if (port < 0 || port >= __atomic_load_n(&priv->port_count, __ATOMIC_ACQUIRE))
+        return false;
+    return __atomic_load_n(&_port(priv, port)->connected, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Return the number of port disconnections so far, so that a change
+ * tells that midio_is_port_connected must be checked again.
+ */
+uint32_t midio_get_disconnect_count(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    return __atomic_load_n(&priv->disconnect_count, __ATOMIC_ACQUIRE);
+}
+
+static int _recv_batch(struct midio_private *priv, MIDIO_MSG *msgs, int max_count, uint64_t deadline, bool output);
+
+/**
+ * Deliver input messages to the handler, one by one, until the pump is
+ * stopped. Return the stop code, see midio_stop.
+ */
+int midio_start_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msg))
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    MIDIO_MSG msgs[MIDIO_BATCH_SIZE];
+
+    for (;;) {
+        // get next midi messages, waking up for scheduled sends and
+        // blocked output
+        int count = _recv_batch(priv, msgs, MIDIO_BATCH_SIZE, midio_get_next_send_time(me), true);
+        if (count < 0)
+            return priv->stop_code;
+
+        // dispatch them one by one
+        for (int i = 0; i < count; i++)
+            handler(ctx, &msgs[i]);
+
+        // write everything produced by this batch
+        midio_flush(me);
+    }
+}
+
+/**
+ * Deliver input messages to the handler, in batches, until the pump is
+ * stopped. Return the stop code, see midio_stop.
+ */
+int midio_start_batch_pump(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count))
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    MIDIO_MSG msgs[MIDIO_BATCH_SIZE];
 
     for (;;) {
-        // get next midi message
-        midio_recv(me, &msg);
-        if (msg.size == 0)
+        // get next midi messages, or none when the deadline is reached
+        // or when blocked output can be written again
+        uint64_t deadline = priv->pump_deadline;
+        priv->pump_deadline = 0;
+        int count = _recv_batch(priv, msgs, MIDIO_BATCH_SIZE, deadline, true);
+        if (count < 0)
+            return priv->stop_code;
+
+        // dispatch them at once; the handler flushes the output
+        handler(ctx, msgs, count);
+    }
+}
+
+/**
+ * Ask the batch pump to call its handler, with no message if none is
+ * received in the meantime, at the given time. Must be called from the
+ * handler and applies to the next wait only.
+ */
+void midio_set_pump_deadline(MIDIO *me, uint64_t time)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    priv->pump_deadline = time;
+}
+
+/**
+ * Ask the pump, or midio_recv_batch, to return as soon as possible with
+ * the given code. May be called from any thread, a handler included.
+ */
+void midio_stop(MIDIO *me, int code)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    uint64_t one = 1;
+
+    __atomic_store_n(&priv->stop_request, code, __ATOMIC_RELEASE);
+    if (write(priv->stop_fd, &one, sizeof(one)) != sizeof(one))
+        _fatal_error("eventfd error: errno=%d", errno);
+}
+
+/**
+ * Stop the pump with code 0 on SIGINT, SIGTERM or SIGHUP, received by a
+ * signalfd instead of a handler. The signals are blocked, hence this must
+ * be called before any other thread is created.
+ */
+void midio_stop_on_signals(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) == -1)
+        _fatal_error("sigprocmask error: errno=%d", errno);
+    priv->signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (priv->signal_fd == -1)
+        _fatal_error("signalfd error: errno=%d", errno);
+
+    uint32_t events = 0;
+    _set_events(priv, priv->signal_fd, MIDIO_TAG_SIGNAL, &events, EPOLLIN);
+}
+
+/**
+ * Return the code the pump has been stopped with.
+ */
+int midio_get_stop_code(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    return priv->stop_code;
+}
+
+static void _set_stopped(struct midio_private *priv, int code)
+{
+    if (!priv->stopped) {
+        priv->stop_code = code;
+        priv->stopped = true;
+    }
+}
+
+/**
+ * Turn pedal key events into control changes: pressed is 127, released
+ * is 0. Auto-repeat and other events are skipped.
+ */
+static bool _parse_next_evdev(struct midio_port *port, MIDIO_MSG *msg)
+{
+    while (port->rx_pos + (int)sizeof(struct input_event) <= port->rx_len) {
+        struct input_event event;
+        memcpy(&event, port->rx_buf + port->rx_pos, sizeof(event));
+        port->rx_pos += sizeof(event);
+        if (event.type != EV_KEY || event.value > 1)
+            continue;
+
+        for (int i = 0; i < port->evdev.key_count; i++) {
+            if (port->evdev.keys[i] == event.code) {
+                if (port->evdev.restamp)
+                    msg->time = midio_get_time();
+                else
+                    msg->time = (uint64_t)event.time.tv_sec * 1000000000 + (uint64_t)event.time.tv_usec * 1000;
+                msg->port = port->index;
+                msg->ump[0] = midio_ump_midi1(0xB0, _evdev_cc[i], event.value ? 0x7F : 0x00);
+                msg->ump[1] = 0;
+                return true;
+            }
+        }
+    }
+    port->rx_pos = port->rx_len;
+    return false;
+}
+
+static bool _parse_next(struct midio_port *port, MIDIO_MSG *msg)
+{
+    if (port->evdev.key_count)
+        return _parse_next_evdev(port, msg);
+
+    while (port->rx_pos < port->rx_len) {
+        port->rx_pos += (int)midio_parser_feed(&port->parser, port->rx_buf + port->rx_pos, port->rx_len - port->rx_pos, msg);
+        if (msg->ump[0]) {
+            msg->port = port->index;
+            msg->time = port->rx_time;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _push_ready(struct midio_private *priv, struct midio_port *port)
+{
+    if (port->ready)
+        return;
+    port->ready = true;
+    port->ready_next = NULL;
+    if (priv->ready_tail)
+        priv->ready_tail->ready_next = port;
+    else
+        priv->ready_head = port;
+    priv->ready_tail = port;
+}
+
+static struct midio_port *_pop_ready(struct midio_private *priv)
+{
+    struct midio_port *port = priv->ready_head;
+    priv->ready_head = port->ready_next;
+    if (!priv->ready_head)
+        priv->ready_tail = NULL;
+    port->ready = false;
+    return port;
+}
+
+/**
+ * Arm the timer to expire at the given time, or disarm it if time is 0.
+ */
+static void _set_timer(struct midio_private *priv, uint64_t time)
+{
+    if (time == priv->timer_time)
+        return;
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t)(time / 1000000000);
+    spec.it_value.tv_nsec = (long)(time % 1000000000);
+    if (timerfd_settime(priv->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        _fatal_error("timerfd error: errno=%d", errno);
+    priv->timer_time = time;
+}
+
+/**
+ * Wait for input until deadline (0 = forever) and read a chunk from each
+ * ready port. If output is set, also wait for blocked ports to accept
+ * bytes again. Return false if the deadline has been reached, if a
+ * blocked port became writable or if a port has been disconnected. If
+ * wait is false, only take what is already available.
+ */
+static bool _wait_and_read(struct midio_private *priv, uint64_t deadline, bool output, bool wait)
+{
+    if (wait) {
+        if (deadline && midio_get_time() >= deadline)
+            return false;
+        _set_timer(priv, deadline);
+    }
+
+    // blocked ports are watched until they become writable once
+    if (output) {
+        for (struct midio_port *port = priv->tx_ports; port; port = port->tx_next) {
+            if (port->tx_blocked && port->connected)
+                _set_port_events(priv, port, EPOLLIN | EPOLLOUT);
+        }
+    }
+
+    struct epoll_event events[MIDIO_MAX_EVENTS];
+    int count;
+    do {
+        count = epoll_wait(priv->epoll_fd, events, MIDIO_MAX_EVENTS, wait ? -1 : 0);
+    } while (count == -1 && errno == EINTR);
+    if (count == -1)
+        _fatal_error("epoll error: errno=%d", errno);
+
+    // only the fds reported ready are visited
+    bool timeout = false;
+    bool ready = false;
+    bool writable = false;
+    uint32_t disconnect_count = priv->disconnect_count;
+    for (int i = 0; i < count; i++) {
+        uint32_t tag = events[i].data.u32;
+
+        if (tag == MIDIO_TAG_TIMER) {
+            uint64_t expirations;
+            if (read(priv->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                priv->timer_time = 0;
+                timeout = true;
+            }
             continue;
+        }
+
+        if (tag == MIDIO_TAG_DEVICES) {
+            // devices plugged or unplugged
+            _handle_device_events(priv);
+            continue;
+        }
 
-        // dispatch the message
-        handler(ctx, &msg);
+        if (tag == MIDIO_TAG_SIGNAL) {
+            struct signalfd_siginfo info;
+            if (read(priv->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                printf("midio: signal %d received, stopping\n", (int)info.ssi_signo);
+                _set_stopped(priv, 0);
+            }
+            continue;
+        }
+
+        if (tag == MIDIO_TAG_STOP) {
+            uint64_t value;
+            if (read(priv->stop_fd, &value, sizeof(value)) == sizeof(value))
+                _set_stopped(priv, __atomic_load_n(&priv->stop_request, __ATOMIC_ACQUIRE));
+            continue;
+        }
+
+        struct midio_port *port = _port(priv, (int)(tag - MIDIO_TAG_PORTS));
+        if (events[i].events & EPOLLOUT) {
+            writable = true;
+            _set_port_events(priv, port, EPOLLIN);
+        }
+        if (!(events[i].events & ~EPOLLOUT) || !port->connected)
+            continue;
+
+        // bytes not parsed yet are kept, the rest is read later
+        if (port->ready) {
+            ready = true;
+            continue;
+        }
+
+        // read a whole chunk and queue the port for parsing
+        do_read:;
+        ssize_t rx = read(port->fd, port->rx_buf, sizeof(port->rx_buf));
+        if (rx == -1 && errno == EINTR)
+            goto do_read;
+        if (rx == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;  // spurious wakeup, nothing to read yet
+        if (rx <= 0) {
+            // end of stream or device error: the device is gone
+            _disconnect_port(priv, port);
+            continue;
+        }
+        port->rx_pos = 0;
+        port->rx_len = (int)rx;
+        port->rx_time = midio_get_time();
+        _push_ready(priv, port);
+        ready = true;
     }
+    bool lost = priv->disconnect_count != disconnect_count;
+    return ready || !(timeout || writable || lost || priv->stopped);
 }
 
+/**
+ * Wait for one message. msg->ump[0] is 0 if there is none, see
+ * midio_recv_batch.
+ */
 void midio_recv(MIDIO *me, MIDIO_MSG *msg)
+{
+    if (midio_recv_batch(me, msg, 1) <= 0)
+        msg->ump[0] = 0;
+}
+
+/**
+ * Wait until at least one message is available, then fill msgs with up to
+ * max_count messages taken from all ports having pending input. Return the
+ * number of messages stored in msgs, 0 if a port got disconnected meanwhile
+ * (see midio_get_disconnect_count), or -1 once stopped. The output is left
+ * untouched, so this may run on a thread other than the one owning the
+ * output.
+ */
+int midio_recv_batch(MIDIO *me, MIDIO_MSG *msgs, int max_count)
 {
     struct midio_private *priv = (struct midio_private *)me;
+    return _recv_batch(priv, msgs, max_count, 0, false);
+}
+
+static int _recv_batch(struct midio_private *priv, MIDIO_MSG *msgs, int max_count, uint64_t deadline, bool output)
+{
+    int count = 0;
+
+    if (priv->stopped)
+        return -1;
+
+    // ports still having bytes from a previous wake do not keep new
+    // input waiting: it joins the ready list first
+    if (priv->ready_head)
+        _wait_and_read(priv, 0, output, false);
+
+    for (;;) {
+        // deliver messages from bytes already read, taking one message
+        // per ready port in turn so that a busy port cannot delay the
+        // others; a port goes back to the end of the list while it has
+        // bytes left
+        while (priv->ready_head && count < max_count) {
+            struct midio_port *port = _pop_ready(priv);
+            if (_parse_next(port, &msgs[count])) {
+                count++;
+                if (port->rx_pos < port->rx_len)
+                    _push_ready(priv, port);
+            }
+        }
+        if (count > 0)
+            return count;
+
+        // all ready ports are drained: wait for new bytes
+        if (!_wait_and_read(priv, deadline, output, true))
+            return priv->stopped ? -1 : 0;
+    }
+}
+
+/**
+ * Reader mode: read one port, parse its stream and pass the messages of
+ * each chunk read to the handler, until the readers are stopped or the
+ * device is gone.
+ */
+static void *_reader_thread(void *arg)
+{
+    struct midio_port *port = arg;
+    struct midio_private *priv = port->owner;
+    MIDIO_MSG msgs[MIDIO_BATCH_SIZE];
+    struct pollfd fds[2] = {
+        { .fd = port->fd, .events = POLLIN },
+        { .fd = priv->reader_stop_fd, .events = POLLIN },
+    };
 
-    for (int i = 0; i < priv->dev_count; i++)
-        priv->pollfds[i].revents = 0;
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            _fatal_error("poll error: errno=%d", errno);
+        }
+        if (fds[1].revents)
+            break;
 
-    do_poll:;
-    int rv = poll(priv->pollfds, priv->dev_count, -1);
-    if (rv == -1) {
-        if (errno == EINTR)
-            goto do_poll;
-        _fatal_error("poll error: errno=%d", errno);
+        ssize_t rx = read(port->fd, port->rx_buf, sizeof(port->rx_buf));
+        if (rx == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (rx <= 0) {
+            // end of stream or device error, or /dev/null once the
+            // device watch has seen the device go
+            _disconnect_port(priv, port);
+            break;
+        }
+        port->rx_pos = 0;
+        port->rx_len = (int)rx;
+        port->rx_time = midio_get_time();
+
+        int count = 0;
+        while (_parse_next(port, &msgs[count])) {
+            if (++count == MIDIO_BATCH_SIZE) {
+                priv->reader_handler(priv->reader_ctx, msgs, count);
+                count = 0;
+            }
+        }
+        if (count > 0)
+            priv->reader_handler(priv->reader_ctx, msgs, count);
     }
+    return NULL;
+}
+
+static void _start_reader(struct midio_port *port)
+{
+    int err = pthread_create(&port->reader, NULL, _reader_thread, port);
+    if (err)
+        _fatal_error("cannot create reader thread: errno=%d", err);
+    port->reader_running = true;
+}
+
+static void _join_reader(struct midio_port *port)
+{
+    if (port->reader_running) {
+        pthread_join(port->reader, NULL);
+        port->reader_running = false;
+    }
+}
+
+/**
+ * Read each port from a thread of its own, so that a busy device never
+ * delays the input of another one, and deliver the messages to the
+ * handler, called from all these threads at once. Ports plugged later get
+ * their reader too. The calling thread handles hot-plug, signals and stop
+ * requests; the readers inherit its scheduling policy, priority and CPU
+ * affinity. The output is left untouched. Return the stop code once all
+ * readers are done, see midio_stop.
+ */
+int midio_start_readers(MIDIO *me, void *ctx, void (* handler)(void *ctx, MIDIO_MSG *msgs, int count))
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    priv->reader_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (priv->reader_stop_fd == -1)
+        _fatal_error("eventfd error: errno=%d", errno);
+    priv->reader_ctx = ctx;
+    priv->reader_handler = handler;
+
+    // ports leave the epoll set for their reader
+    for (int i = 0; i < priv->port_count; i++) {
+        struct midio_port *port = _port(priv, i);
+        _set_port_events(priv, port, 0);
+        if (port->connected)
+            _start_reader(port);
+    }
+
+    while (!priv->stopped)
+        _wait_and_read(priv, 0, false, true);
+
+    // the eventfd stays readable, waking every reader
+    uint64_t one = 1;
+    if (write(priv->reader_stop_fd, &one, sizeof(one)) != sizeof(one))
+        _fatal_error("eventfd error: errno=%d", errno);
+    for (int i = 0; i < priv->port_count; i++)
+        _join_reader(_port(priv, i));
+    return priv->stop_code;
+}
+
+static struct midio_chunk *_take_chunk(struct midio_private *priv, struct midio_port *port)
+{
+    struct midio_chunk *chunk = priv->free_chunks;
+    priv->free_chunks = chunk->next;
+    priv->free_count--;
+    if (++port->tx_chunks <= port->tx_reserve)
+        __atomic_sub_fetch(&priv->reserved_free, 1, __ATOMIC_RELAXED);
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = 0;
+    return chunk;
+}
+
+static void _set_depth(struct midio_port *port, size_t depth)
+{
+    __atomic_store_n(&port->tx_depth, depth, __ATOMIC_RELAXED);
+}
+
+static void _release_head(struct midio_private *priv, struct midio_port *port)
+{
+    struct midio_chunk *chunk = port->tx_head;
+    port->tx_head = chunk->next;
+    if (!port->tx_head)
+        port->tx_tail = NULL;
+    chunk->next = priv->free_chunks;
+    priv->free_chunks = chunk;
+    priv->free_count++;
+    if (port->tx_chunks-- <= port->tx_reserve)
+        __atomic_add_fetch(&priv->reserved_free, 1, __ATOMIC_RELAXED);
+}
+
+static void _drop_queue(struct midio_private *priv, struct midio_port *port)
+{
+    while (port->tx_head)
+        _release_head(priv, port);
+    port->tx_blocked = false;
+    _set_depth(port, 0);
+}
+
+/**
+ * Write as much of the bytes queued for the given port as the device takes
+ * without blocking, up to MIDIO_MAX_IOV chunks per system call. Return
+ * false if some bytes are left because the device is full.
+ */
+static bool _write_port(struct midio_private *priv, struct midio_port *port)
+{
+    while (port->tx_head) {
+        struct iovec iov[MIDIO_MAX_IOV];
+        int iov_count = 0;
+        for (struct midio_chunk *chunk = port->tx_head; chunk && iov_count < MIDIO_MAX_IOV; chunk = chunk->next) {
+            iov[iov_count].iov_base = chunk->data + chunk->start;
+            iov[iov_count].iov_len = chunk->end - chunk->start;
+            iov_count++;
+        }
 
-    for (int i = 0; i < priv->dev_count; i++) {
-        if (priv->pollfds[i].revents) {
-            do_read:;
-            ssize_t rx = read(priv->devs[i], msg->bytes, 3);
-            if (rx == -1) {
-                if (errno == EINTR)
-                    goto do_read;
-                _fatal_error("read error: errno=%d", errno);
+        ssize_t ret = writev(port->fd, iov, iov_count);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                priv->stats.block_count++;
+                return false;
             }
-            msg->port = i;
-            msg->size = (int)rx;
+            // the device is gone or broken: what is queued for it is lost
+            printf("midio: port %s write error: errno=%d\n", port->name, errno);
+            _drop_queue(priv, port);
+            return true;
+        }
+        priv->stats.write_count++;
+
+        // give back written chunks, keep the rest of a partial one
+        size_t written = (size_t)ret;
+        _set_depth(port, port->tx_depth - written);
+        while (written > 0) {
+            struct midio_chunk *chunk = port->tx_head;
+            size_t len = chunk->end - chunk->start;
+            if (written < len) {
+                chunk->start += (int)written;
+                break;
+            }
+            written -= len;
+            _release_head(priv, port);
+        }
+    }
+    return true;
+}
+
+/**
+ * Return an equal share of the output pool among the connected ports.
+ */
+static size_t _pool_share(struct midio_private *priv)
+{
+    int out_port_count = __atomic_load_n(&priv->out_port_count, __ATOMIC_RELAXED);
+    return (size_t)MIDIO_CHUNK_COUNT * MIDIO_CHUNK_SIZE / (out_port_count > 0 ? out_port_count : 1);
+}
+
+/**
+ * Append data to the output queue of a port. A message is either queued
+ * whole or, if the pool has not enough room left, dropped and counted.
+ * Each port may take the free chunks of its reserve, and borrow the free
+ * chunks nobody keeps: a device falling behind never starves the others,
+ * and a SysEx dump larger than a share of the pool still goes through.
+ */
+static bool _queue(struct midio_private *priv, struct midio_port *port, const void *data, size_t size)
+{
+    size_t tail_room = port->tx_tail ? MIDIO_CHUNK_SIZE - port->tx_tail->end : 0;
+    int need = size > tail_room ? (int)((size - tail_room + MIDIO_CHUNK_SIZE - 1) / MIDIO_CHUNK_SIZE) : 0;
+    int kept = __atomic_load_n(&priv->reserved_free, __ATOMIC_RELAXED);
+    if (port->tx_chunks < port->tx_reserve)
+        kept -= port->tx_reserve - port->tx_chunks;
+    if (need > priv->free_count - kept) {
+        priv->stats.drop_count++;
+        return false;
+    }
+
+    // a port with nothing queued joins the ports to flush
+    if (!port->tx_head && size > 0) {
+        port->tx_next = priv->tx_ports;
+        priv->tx_ports = port;
+    }
+    _set_depth(port, port->tx_depth + size);
+    if (port->tx_depth > priv->stats.max_depth)
+        priv->stats.max_depth = port->tx_depth;
+
+    const uint8_t *src = data;
+    while (size > 0) {
+        struct midio_chunk *chunk = port->tx_tail;
+        if (!chunk || chunk->end == MIDIO_CHUNK_SIZE) {
+            chunk = _take_chunk(priv, port);
+            if (port->tx_tail)
+                port->tx_tail->next = chunk;
+            else
+                port->tx_head = chunk;
+            port->tx_tail = chunk;
+        }
+        size_t len = MIDIO_CHUNK_SIZE - chunk->end;
+        if (len > size)
+            len = size;
+        memcpy(chunk->data + chunk->end, src, len);
+        chunk->end += (int)len;
+        src += len;
+        size -= len;
+    }
+    priv->stats.msg_count++;
+    return true;
+}
+
+/**
+ * Tell whether a message must reach the device even when its queue is
+ * over the limit: note offs and channel mode messages (all notes off...),
+ * so that nothing is left sounding.
+ */
+static bool _is_essential(const uint8_t *data, size_t size)
+{
+    int cmd = data[0] & 0xF0;
+    return size == 3 && (cmd == 0x80 || (cmd == 0x90 && data[2] == 0) || (cmd == 0xB0 && data[1] >= 120));
+}
+
+/**
+ * Return the number of leading bytes identifying the value a message
+ * sets, so that a newer message with the same ones replaces it, or 0 if
+ * it cannot be merged. Data entry and (N)RPN selection are sequences,
+ * and are never merged.
+ */
+static int _merge_key_size(const uint8_t *data, size_t size)
+{
+    switch (data[0] & 0xF0) {
+        case 0xA0:
+            return size == 3 ? 2 : 0;
+        case 0xB0:
+            if (size != 3 || data[1] == 6 || data[1] == 38 || (data[1] >= 96 && data[1] <= 101) || data[1] >= 120)
+                return 0;
+            return 2;
+        case 0xD0:
+            return size == 2 ? 1 : 0;
+        case 0xE0:
+            return size == 3 ? 1 : 0;
+    }
+    return 0;
+}
+
+/**
+ * Overwrite the value of the last queued message setting the same value
+ * as data, if it is in the tail chunk: the cost is bounded by the chunk
+ * size however long the queue grows. Bytes are walked message by
+ * message; those before the first status byte end a message started in
+ * the previous chunk, or partially written, and are not touched. Return
+ * false if there is no such message.
+ */
+static bool _merge(struct midio_port *port, const uint8_t *data, size_t size)
+{
+    int key_size = _merge_key_size(data, size);
+    if (key_size == 0)
+        return false;
+
+    uint8_t *bytes[3];      // the message being walked
+    int count = 0;
+    uint8_t *match[3] = {NULL};
+    bool sysex = false;
+    struct midio_chunk *chunk = port->tx_tail;
+    if (!chunk)
+        return false;
+    for (uint8_t *p = chunk->data + chunk->start; p < chunk->data + chunk->end; p++) {
+        if (*p >= 0xF8)
+            continue;
+        if (*p & 0x80) {
+            sysex = *p == 0xF0;
+            bytes[0] = p;
+            count = *p == 0xF0 || *p == 0xF7 ? 0 : 1;
+        } else if (!sysex && count > 0 && count < 3) {
+            bytes[count++] = p;
+        } else {
+            continue;
+        }
+        if (count == (int)size && *bytes[0] == data[0] && (key_size == 1 || *bytes[1] == data[1]))
+            memcpy(match, bytes, sizeof(match));
+    }
+    if (!match[0])
+        return false;
+    for (int i = key_size; i < (int)size; i++)
+        *match[i] = data[i];
+    return true;
+}
+
+/**
+ * Queue a message, or a SysEx message, applying the output limit of the
+ * port, by default half of its share of the pool, so that the messages
+ * kept by the overflow policy still find room.
+ */
+static void _queue_limited(struct midio_private *priv, struct midio_port *port, const void *data, size_t size)
+{
+    size_t high_water = port->tx_high_water ? port->tx_high_water : _pool_share(priv) / 2;
+    if (port->tx_depth + size > high_water && size > 0) {
+        if (port->tx_overflow == MIDIO_OVERFLOW_DROP && !_is_essential(data, size)) {
+            priv->stats.drop_count++;
             return;
         }
+        if (port->tx_overflow == MIDIO_OVERFLOW_MERGE && _merge(port, data, size)) {
+            priv->stats.merge_count++;
+            return;
+        }
+    }
+    _queue(priv, port, data, size);
+}
+
+static void _queue_all(struct midio_private *priv, int port_nb, const void *data, size_t size)
+{
+    // ports are added by the thread watching the devices: only those
+    // published are taken; pedals are input only
+    int port_count = __atomic_load_n(&priv->port_count, __ATOMIC_ACQUIRE);
+    if (port_nb == -1) {
+        for (int i = 0; i < port_count; i++) {
+            if (_port(priv, i)->output)
+                _queue_limited(priv, _port(priv, i), data, size);
+        }
+    } else if (port_nb >= 0 && port_nb < port_count && _port(priv, port_nb)->output) {
+        _queue_limited(priv, _port(priv, port_nb), data, size);
+    }
+}
+
+static void _queue_msg(struct midio_private *priv, MIDIO_MSG *msg)
+{
+    // raw MIDI devices only take MIDI 1.0 byte streams
+    uint8_t bytes[3];
+    int size = midio_msg_to_bytes(msg, bytes);
+    if (size > 0)
+        _queue_all(priv, msg->port, bytes, size);
+}
+
+static void _sched_push(struct midio_private *priv, MIDIO_MSG *msg)
+{
+    int i = priv->sched_count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (priv->sched[parent].time <= msg->time)
+            break;
+        priv->sched[i] = priv->sched[parent];
+        i = parent;
     }
+    priv->sched[i] = *msg;
+}
 
-    msg->port = -1;
-    msg->size = 0;
+static void _sched_pop(struct midio_private *priv, MIDIO_MSG *msg)
+{
+    *msg = priv->sched[0];
+    MIDIO_MSG last = priv->sched[--priv->sched_count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= priv->sched_count)
+            break;
+        if (child + 1 < priv->sched_count && priv->sched[child + 1].time < priv->sched[child].time)
+            child++;
+        if (last.time <= priv->sched[child].time)
+            break;
+        priv->sched[i] = priv->sched[child];
+        i = child;
+    }
+    priv->sched[i] = last;
 }
 
+/**
+ * Queue a message for output. Messages are written to the devices by
+ * midio_flush, called after each batch of input messages by
+ * midio_start_pump or by the batch handler, so that all messages for a
+ * port produced by a batch cost a single write.
+ * A message whose time is in the future is held until that time and
+ * released by the first midio_flush following it; see
+ * midio_get_next_send_time.
+ */
 void midio_send(MIDIO *me, MIDIO_MSG *msg)
 {
     struct midio_private *priv = (struct midio_private *)me;
 
-    if (msg->port == -1) {
-        for (int i = 0; i < priv->dev_count; i++) {
-            ssize_t ret = write(priv->devs[i], msg->bytes, msg->size);
-            if (ret != msg->size)
-                _fatal_error("write error: ret=%d errno=%d", ret, errno);
+    if (msg->time != MIDIO_TIME_NOW && msg->time > midio_get_time()) {
+        if (priv->sched_count < MIDIO_MAX_SCHEDULED) {
+            _sched_push(priv, msg);
+            return;
+        }
+        printf("midio: too many scheduled messages, sending now\n");
+    }
+    _queue_msg(priv, msg);
+}
+
+/**
+ * Queue a SysEx message, F0 to F7 included, for output. Like midio_send,
+ * it is written by midio_flush, as far as the device takes it without
+ * blocking; the rest is written later, when the device has room again.
+ */
+void midio_send_sysex(MIDIO *me, int port_nb, const void *data, size_t size)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    _queue_all(priv, port_nb, data, size);
+}
+
+/**
+ * Write queued output without blocking. Ports that do not take all their
+ * bytes are resumed when they become writable, by the pump, or at the
+ * latest at midio_get_next_send_time.
+ */
+void midio_flush(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    // release scheduled messages that are due
+    if (priv->sched_count > 0) {
+        uint64_t now = midio_get_time();
+        while (priv->sched_count > 0 && priv->sched[0].time <= now) {
+            MIDIO_MSG msg;
+            _sched_pop(priv, &msg);
+            _queue_msg(priv, &msg);
+        }
+    }
+
+    // only ports having something queued are visited; those left with
+    // bytes stay in the list
+    bool blocked = false;
+    struct midio_port **link = &priv->tx_ports;
+    while (*link) {
+        struct midio_port *port = *link;
+        port->tx_blocked = !_write_port(priv, port);
+        if (port->tx_head) {
+            blocked = true;
+            link = &port->tx_next;
+        } else {
+            *link = port->tx_next;
         }
-    } else {
-        ssize_t ret = write(priv->devs[msg->port], msg->bytes, msg->size);
-        if (ret != msg->size)
-            _fatal_error("write error: ret=%d errno=%d", ret, errno);
     }
+    priv->retry_time = blocked ? midio_get_time() + MIDIO_RETRY_TIME : 0;
+}
+
+/**
+ * Write queued output, waiting for the devices to take it, until nothing
+ * is left or timeout ns have elapsed. Messages scheduled after that are
+ * not waited for. Return true if all the output has been written.
+ */
+bool midio_drain(MIDIO *me, uint64_t timeout)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    uint64_t deadline = midio_get_time() + timeout;
+
+    for (;;) {
+        midio_flush(me);
+        if (!priv->tx_ports)
+            return true;
+        uint64_t now = midio_get_time();
+        if (now >= deadline)
+            return false;
+
+        // wait for any of the blocked devices to take more, checking the
+        // others, beyond MIDIO_MAX_EVENTS, every 10 ms
+        struct pollfd fds[MIDIO_MAX_EVENTS];
+        int count = 0;
+        for (struct midio_port *port = priv->tx_ports; port && count < MIDIO_MAX_EVENTS; port = port->tx_next)
+            fds[count++] = (struct pollfd){ .fd = port->fd, .events = POLLOUT };
+        int wait = (int)((deadline - now + 999999) / 1000000);
+        if (poll(fds, count, wait < 10 ? wait : 10) == -1 && errno != EINTR)
+            return false;
+    }
+}
+
+/**
+ * Return the time of the earliest scheduled message, or of the next try
+ * to write blocked output, or 0 if none. The owner of the output must
+ * call midio_flush at that time.
+ */
+uint64_t midio_get_next_send_time(MIDIO *me)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    uint64_t time = priv->sched_count > 0 ? priv->sched[0].time : 0;
+    if (priv->retry_time && (time == 0 || priv->retry_time < time))
+        time = priv->retry_time;
+    return time;
+}
+
+/**
+ * Return the output counters. They belong to the output owner; another
+ * thread may read them slightly behind.
+ */
+void midio_get_stats(MIDIO *me, MIDIO_STATS *stats)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    *stats = priv->stats;
+}
+
+/**
+ * Limit the output queued for a port to high_water bytes (0 for the
+ * default, see _queue_limited), beyond which overflow applies, so that a slow device, such as
+ * a DIN interface at 31250 baud, falls behind by a bounded delay. Port -1
+ * sets the limit of all ports, including those plugged later. Must be
+ * called by the output owner.
+ */
+void midio_set_output_limit(MIDIO *me, int port_nb, size_t high_water, enum midio_overflow overflow)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+
+    if (port_nb == -1) {
+        priv->high_water = high_water;
+        priv->overflow = overflow;
+    }
+    int port_count = __atomic_load_n(&priv->port_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < port_count; i++) {
+        if (port_nb == -1 || port_nb == i) {
+            _port(priv, i)->tx_high_water = high_water;
+            _port(priv, i)->tx_overflow = overflow;
+        }
+    }
+}
+
+/**
+ * Return the number of bytes queued for a port and not written yet, or
+ * for all ports if port is -1. May be called from any thread.
+ */
+size_t midio_get_output_depth(MIDIO *me, int port_nb)
+{
+    struct midio_private *priv = (struct midio_private *)me;
+    int port_count = __atomic_load_n(&priv->port_count, __ATOMIC_ACQUIRE);
+    size_t depth = 0;
+
+    for (int i = 0; i < port_count; i++) {
+        if (port_nb == -1 || port_nb == i)
+            depth += __atomic_load_n(&_port(priv, i)->tx_depth, __ATOMIC_RELAXED);
+    }
+    return depth;
 }
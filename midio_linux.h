@@ -0,0 +1,23 @@
+//
+//  midio_linux.h
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#ifndef _MIDIO_LINUX_H_
+#define _MIDIO_LINUX_H_
+
+#include "midio.h"
+
+
+/*** prototypes ***/
+
+// for backends built on top of the file descriptor based Linux backend
+int midio_linux_add_port(MIDIO *me, const char *name, int fd);
+
+// input devices taken as pedals, by name; to be called before midio_open
+void midio_linux_add_pedal(MIDIO *me, const char *name);
+
+
+#endif
@@ -0,0 +1,143 @@
+//
+//  midio_loop.c
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "midio_loop.h"
+#include "midio_linux.h"
+
+
+/*** types ***/
+
+struct midio_loop {
+    int port_count;
+    const char *names[MIDIO_LOOP_MAX_PORTS];
+    int driver_fds[MIDIO_LOOP_MAX_PORTS];
+};
+
+
+/*** globals ***/
+
+static struct midio_loop _loop = {
+    .port_count = 3,
+    .names = { "Keyboard", "BeatStep", "Virtual Output" },
+};
+
+
+/*** functions ***/
+
+static void _fatal_error(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    abort();
+}
+
+/**
+ * Define the fake ports created by the next midio_open. By default, the
+ * ports are "Keyboard", "BeatStep" and "Virtual Output". Names are not
+ * copied and must stay valid.
+ */
+void midio_loop_set_ports(const char *const *names, int count)
+{
+    if (count > MIDIO_LOOP_MAX_PORTS)
+        _fatal_error("midio_loop: too many ports: %d", count);
+
+    _loop.port_count = count;
+    for (int i = 0; i < count; i++)
+        _loop.names[i] = names[i];
+}
+
+static void _plug(MIDIO *me, int port)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        _fatal_error("midio_loop: socketpair error: errno=%d", errno);
+
+    if (midio_linux_add_port(me, _loop.names[port], fds[0]) != port)
+        _fatal_error("midio_loop: cannot add port %s", _loop.names[port]);
+    _loop.driver_fds[port] = fds[1];
+}
+
+void midio_loop_open(MIDIO *me)
+{
+    for (int i = 0; i < _loop.port_count; i++) {
+        _plug(me, i);
+        printf("midio: open loopback port %d (%s)\n", i, _loop.names[i]);
+    }
+}
+
+/**
+ * Return the driver side of a fake port: bytes written to it are received
+ * by the backend as input of the port, bytes sent by the backend to the
+ * port can be read from it.
+ */
+int midio_loop_get_fd(int port)
+{
+    return _loop.driver_fds[port];
+}
+
+/**
+ * Feed raw MIDI bytes to the input of a fake port.
+ */
+void midio_loop_inject(int port, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size > 0) {
+        ssize_t ret = write(_loop.driver_fds[port], p, size);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            _fatal_error("midio_loop: write error: errno=%d", errno);
+        }
+        p += ret;
+        size -= ret;
+    }
+}
+
+/**
+ * Read raw MIDI bytes sent by the backend to a fake port. Block until at
+ * least one byte is available and return the number of bytes read.
+ */
+ssize_t midio_loop_capture(int port, void *buf, size_t size)
+{
+    for (;;) {
+        ssize_t ret = read(_loop.driver_fds[port], buf, size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        return ret;
+    }
+}
+
+/**
+ * Simulate the disconnection of the device behind a fake port.
+ */
+void midio_loop_unplug(int port)
+{
+    if (_loop.driver_fds[port] >= 0) {
+        close(_loop.driver_fds[port]);
+        _loop.driver_fds[port] = -1;
+    }
+}
+
+/**
+ * Simulate the reconnection of the device behind a fake port, once its
+ * disconnection has been seen by the backend. Like a hot-plug event, it
+ * must happen on the thread receiving input; the port keeps its index.
+ */
+void midio_loop_plug(MIDIO *me, int port)
+{
+    if (_loop.driver_fds[port] == -1)
+        _plug(me, port);
+}
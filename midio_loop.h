@@ -0,0 +1,47 @@
+//
+//  midio_loop.h
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#ifndef _MIDIO_LOOP_H_
+#define _MIDIO_LOOP_H_
+
+/*
+ * In-process loopback backend.
+ *
+ * Built by compiling midio_linux.c with MIDIO_LOOP defined and linking
+ * midio_loop.c. Instead of /dev/snd devices, midio_open creates one
+ * socket pair per fake port. The backend side behaves exactly like a
+ * rawmidi device, so the whole pump, parser and output path is exercised.
+ * The driver side is used by a test or benchmark driver to inject input
+ * bytes and to capture output bytes.
+ *
+ * There is one set of fake ports per process.
+ */
+
+#include <sys/types.h>
+#include "midio.h"
+
+
+/*** literals ***/
+
+#define MIDIO_LOOP_MAX_PORTS    16
+
+
+/*** prototypes ***/
+
+// driver API
+void midio_loop_set_ports(const char *const *names, int count);
+int midio_loop_get_fd(int port);
+void midio_loop_inject(int port, const void *data, size_t size);
+ssize_t midio_loop_capture(int port, void *buf, size_t size);
+void midio_loop_unplug(int port);
+void midio_loop_plug(MIDIO *me, int port);
+
+// backend hook, called by midio_open
+void midio_loop_open(MIDIO *me);
+
+
+#endif
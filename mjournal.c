@@ -0,0 +1,345 @@
+//
+//  mjournal.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mjournal.h"
+
+
+/*** literals ***/
+
+// Standard MIDI File timing: 120 bpm and 5000 ticks per quarter note,
+// i.e. 100 us per tick
+#define SMF_DIVISION    5000
+#define SMF_TEMPO       500000      // us per quarter note
+#define SMF_TICK_NS     100000
+
+#define MAX_TRACKS      32          // one per port and direction
+
+
+/*** types ***/
+
+struct track {
+    uint32_t dir;
+    int32_t port;
+    uint64_t tick;      // time of the last event
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+
+/*** functions ***/
+
+/**
+ * Create the journal file, replacing any previous one, with room for
+ * size events, a power of two. Return NULL on error.
+ */
+MJOURNAL *mjournal_create(const char *path, int size)
+{
+    if (size <= 0 || (size & (size - 1))) {
+        printf("mjournal: size must be a power of two\n");
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("mjournal: cannot create %s (errno=%d)\n", path, errno);
+        return NULL;
+    }
+    size_t map_size = sizeof(MJOURNAL_HEADER) + (size_t)size * sizeof(MJOURNAL_EVENT);
+    if (ftruncate(fd, (off_t)map_size) == -1) {
+        printf("mjournal: cannot resize %s (errno=%d)\n", path, errno);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("mjournal: cannot map %s (errno=%d)\n", path, errno);
+        close(fd);
+        return NULL;
+    }
+
+    // write every page now, so that appending does not fault
+    memset(map, 0, map_size);
+
+    MJOURNAL *me = calloc(1, sizeof(*me));
+    me->fd = fd;
+    me->map_size = map_size;
+    me->header = map;
+    me->events = (MJOURNAL_EVENT *)(me->header + 1);
+    me->mask = size - 1;
+    me->header->size = size;
+    me->header->event_size = sizeof(MJOURNAL_EVENT);
+    memcpy(me->header->magic, MJOURNAL_MAGIC, sizeof(me->header->magic));
+    return me;
+}
+
+/**
+ * Write the journal back to its file and close it.
+ */
+void mjournal_destroy(MJOURNAL *me)
+{
+    if (!me)
+        return;
+    msync(me->header, me->map_size, MS_SYNC);
+    munmap(me->header, me->map_size);
+    close(me->fd);
+    free(me);
+}
+
+/**
+ * Append a message. A message received keeps its time, if any; a message
+ * sent is stamped with now, the time it is sent, unless it is scheduled
+ * later. The slot is marked incomplete while it is written, so that a
+ * reader never takes half an event.
+ */
+void mjournal_add(MJOURNAL *me, enum mjournal_dir dir, const MIDIO_MSG *msg, uint64_t now)
+{
+    uint64_t pos = __atomic_fetch_add(&me->header->head, 1, __ATOMIC_RELAXED);
+    MJOURNAL_EVENT *event = &me->events[pos & me->mask];
+
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (dir == MJOURNAL_OUT)
+        event->time = msg->time > now ? msg->time : now;
+    else
+        event->time = msg->time != MIDIO_TIME_NOW ? msg->time : now;
+    event->ump[0] = msg->ump[0];
+    event->ump[1] = msg->ump[1];
+    event->port = msg->port;
+    event->dir = dir;
+    __atomic_store_n(&event->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int _compare_events(const void *a, const void *b)
+{
+    const MJOURNAL_EVENT *ea = a;
+    const MJOURNAL_EVENT *eb = b;
+    if (ea->time != eb->time)
+        return ea->time < eb->time ? -1 : 1;
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+/**
+ * Copy the complete events of the journal, oldest first. Return their
+ * number.
+ */
+static size_t _read_events(const MJOURNAL_HEADER *header, MJOURNAL_EVENT *events)
+{
+    const MJOURNAL_EVENT *slots = (const MJOURNAL_EVENT *)(header + 1);
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t pos = head > header->size ? head - header->size : 0;
+    size_t count = 0;
+
+    for (; pos < head; pos++) {
+        const MJOURNAL_EVENT *slot = &slots[pos & (header->size - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            continue;
+        events[count] = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // overwritten while being copied
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1)
+            continue;
+        events[count].seq = pos + 1;
+        count++;
+    }
+    return count;
+}
+
+static void _put(struct track *track, const void *data, size_t size)
+{
+    if (track->size + size > track->capacity) {
+        track->capacity = (track->size + size) * 2;
+        track->data = realloc(track->data, track->capacity);
+    }
+    memcpy(track->data + track->size, data, size);
+    track->size += size;
+}
+
+static void _put_byte(struct track *track, uint8_t byte)
+{
+    _put(track, &byte, 1);
+}
+
+/**
+ * Variable-length quantity: 7 bits per byte, most significant first.
+ */
+static void _put_var(struct track *track, uint32_t value)
+{
+    uint8_t buf[5];
+    int i = sizeof(buf);
+    buf[--i] = value & 0x7F;
+    while (value >>= 7)
+        buf[--i] = 0x80 | (value & 0x7F);
+    _put(track, buf + i, sizeof(buf) - i);
+}
+
+static void _put_event(struct track *track, uint64_t tick, const MIDIO_MSG *msg)
+{
+    uint8_t bytes[3];
+    int size = midio_msg_to_bytes(msg, bytes);
+    if (size == 0)
+        return;
+
+    _put_var(track, (uint32_t)(tick - track->tick));
+    track->tick = tick;
+    if (bytes[0] >= 0xF0) {
+        // system messages only fit in a track as escaped data
+        _put_byte(track, 0xF7);
+        _put_var(track, size);
+    }
+    _put(track, bytes, size);
+}
+
+static void _put_name(struct track *track)
+{
+    char name[32];
+    if (track->port == -1)
+        snprintf(name, sizeof(name), "%s all", track->dir == MJOURNAL_IN ? "in" : "out");
+    else
+        snprintf(name, sizeof(name), "%s %d", track->dir == MJOURNAL_IN ? "in" : "out", track->port);
+    _put_byte(track, 0);
+    _put_byte(track, 0xFF);
+    _put_byte(track, 0x03);
+    _put_var(track, (uint32_t)strlen(name));
+    _put(track, name, strlen(name));
+}
+
+static void _put_end(struct track *track)
+{
+    static const uint8_t end[] = { 0x00, 0xFF, 0x2F, 0x00 };
+    _put(track, end, sizeof(end));
+}
+
+static void _write_u32(FILE *file, uint32_t value)
+{
+    uint8_t buf[4] = { value >> 24, value >> 16, value >> 8, value };
+    fwrite(buf, 1, sizeof(buf), file);
+}
+
+static void _write_chunk(FILE *file, const char *type, const void *data, size_t size)
+{
+    fwrite(type, 1, 4, file);
+    _write_u32(file, (uint32_t)size);
+    fwrite(data, 1, size, file);
+}
+
+/**
+ * Write events to a format 1 Standard MIDI File: a tempo track, then a
+ * track per port and direction, named "in N" or "out N". Return -1 on
+ * error.
+ */
+static int _write_smf(const char *smf_path, const MJOURNAL_EVENT *events, size_t count)
+{
+    struct track tracks[MAX_TRACKS] = {0};
+    int track_count = 0;
+    size_t skip_count = 0;
+
+    // conductor track
+    struct track *tempo = &tracks[track_count++];
+    static const uint8_t tempo_event[] = { 0x00, 0xFF, 0x51, 0x03, SMF_TEMPO >> 16, (SMF_TEMPO >> 8) & 0xFF, SMF_TEMPO & 0xFF };
+    _put(tempo, tempo_event, sizeof(tempo_event));
+    _put_end(tempo);
+
+    for (size_t i = 0; i < count; i++) {
+        const MJOURNAL_EVENT *event = &events[i];
+        struct track *track = NULL;
+        for (int t = 1; t < track_count; t++) {
+            if (tracks[t].dir == event->dir && tracks[t].port == event->port) {
+                track = &tracks[t];
+                break;
+            }
+        }
+        if (!track) {
+            if (track_count == MAX_TRACKS) {
+                skip_count++;
+                continue;
+            }
+            track = &tracks[track_count++];
+            track->dir = event->dir;
+            track->port = event->port;
+            _put_name(track);
+        }
+        MIDIO_MSG msg = { .port = event->port, .ump = { event->ump[0], event->ump[1] } };
+        _put_event(track, (event->time - events[0].time) / SMF_TICK_NS, &msg);
+    }
+
+    int result = 0;
+    FILE *file = fopen(smf_path, "wb");
+    if (file) {
+        uint8_t header[6] = { 0, 1, 0, track_count, SMF_DIVISION >> 8, SMF_DIVISION & 0xFF };
+        _write_chunk(file, "MThd", header, sizeof(header));
+        for (int t = 0; t < track_count; t++) {
+            if (t > 0)
+                _put_end(&tracks[t]);
+            _write_chunk(file, "MTrk", tracks[t].data, tracks[t].size);
+        }
+        if (fclose(file) != 0)
+            result = -1;
+    } else {
+        result = -1;
+    }
+    if (result == -1)
+        printf("mjournal: cannot write %s (errno=%d)\n", smf_path, errno);
+    if (skip_count)
+        printf("mjournal: %zu events of more than %d ports skipped\n", skip_count, MAX_TRACKS - 1);
+
+    for (int t = 0; t < track_count; t++)
+        free(tracks[t].data);
+    return result;
+}
+
+/**
+ * Export the events of a journal file, possibly still being recorded,
+ * to a Standard MIDI File. Times start with the oldest event kept.
+ * Return 0 on success, -1 on error.
+ */
+int mjournal_export(const char *path, const char *smf_path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("mjournal: cannot open %s (errno=%d)\n", path, errno);
+        return -1;
+    }
+    struct stat st;
+    MJOURNAL_HEADER *header = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(MJOURNAL_HEADER))
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        printf("mjournal: cannot map %s\n", path);
+        return -1;
+    }
+
+    int result = -1;
+    if (memcmp(header->magic, MJOURNAL_MAGIC, sizeof(header->magic)) ||
+        header->event_size != sizeof(MJOURNAL_EVENT) || header->size == 0 ||
+        (header->size & (header->size - 1)) ||
+        (size_t)st.st_size < sizeof(MJOURNAL_HEADER) + (size_t)header->size * sizeof(MJOURNAL_EVENT)) {
+        printf("mjournal: %s is not a journal\n", path);
+    } else {
+        MJOURNAL_EVENT *events = malloc((size_t)header->size * sizeof(MJOURNAL_EVENT));
+        size_t count = _read_events(header, events);
+
+        // scheduled messages are recorded when sent, ahead of their time
+        qsort(events, count, sizeof(*events), _compare_events);
+        result = _write_smf(smf_path, events, count);
+        if (result == 0)
+            printf("mjournal: %zu events exported to %s\n", count, smf_path);
+        free(events);
+    }
+    munmap(header, st.st_size);
+    return result;
+}
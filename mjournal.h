@@ -0,0 +1,80 @@
+//
+//  mjournal.h
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#ifndef _MJOURNAL_H_
+#define _MJOURNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "midio.h"
+
+
+/*** literals ***/
+
+#define MJOURNAL_MAGIC          "MTJRNL01"
+#define MJOURNAL_CACHE_LINE     64
+
+enum mjournal_dir {
+    MJOURNAL_IN,        // received from a device
+    MJOURNAL_OUT,       // sent, port -1 meaning all ports
+};
+
+
+/*** types ***/
+
+typedef struct mjournal MJOURNAL;
+typedef struct mjournal_header MJOURNAL_HEADER;
+typedef struct mjournal_event MJOURNAL_EVENT;
+
+/**
+ * Start of the journal file, followed by its events.
+ */
+struct mjournal_header {
+    char magic[8];          // MJOURNAL_MAGIC
+    uint32_t size;          // number of events, power of two
+    uint32_t event_size;    // sizeof(MJOURNAL_EVENT)
+
+    // number of events ever appended, the last size of them being kept
+    uint64_t head __attribute__((aligned(MJOURNAL_CACHE_LINE)));
+} __attribute__((aligned(MJOURNAL_CACHE_LINE)));
+
+/**
+ * Message as it went through, stored in slot position % size.
+ */
+struct mjournal_event {
+    uint64_t seq;           // position + 1 once written, 0 while being written
+    uint64_t time;          // monotonic time in ns, see midio_get_time
+    uint32_t ump[2];
+    int32_t port;
+    uint32_t dir;           // enum mjournal_dir
+};
+
+/**
+ * Ring of the last events, kept in a file mapped in memory so that it
+ * survives the process and can be read while it runs. Appending takes
+ * a slot with a single atomic increment and never waits, from any
+ * thread; the oldest events are overwritten.
+ */
+struct mjournal {
+    int fd;
+    size_t map_size;
+    MJOURNAL_HEADER *header;
+    MJOURNAL_EVENT *events;
+    uint32_t mask;
+};
+
+
+/*** prototypes ***/
+
+MJOURNAL *mjournal_create(const char *path, int size);
+void mjournal_destroy(MJOURNAL *me);
+void mjournal_add(MJOURNAL *me, enum mjournal_dir dir, const MIDIO_MSG *msg, uint64_t now);
+int mjournal_export(const char *path, const char *smf_path);
+
+
+#endif
@@ -16,26 +16,67 @@
 
 #define GMU_ASYM_MOD(n, d) (((n)<0) ? ((d)-1+((n)+1)%(d)) : ((n)%(d)))
 
+#define DING_DURATION   (10 * 1000000)  // 10 ms, in ns
 
-static void _ding(MIDIO *out, int note)
+#define PAD_COUNT           MRULES_PAD_COUNT
+#define PAD_COLOR_UNKNOWN   0xFF
+#define LED_INTERVAL        (1 * 1000000)   // 1 ms between LED updates, in ns
+#define LED_MAX_PER_UPDATE  4               // SysEx messages per LED update
+
+#define DEVICE_CHECK_INTERVAL   (100 * 1000000) // 100 ms, in ns, while notes are sounding
+#define RELEASE_MAX_PORTS       8               // output ports whose note offs are deduplicated
+
+
+/**
+ * Send a message, recording it in the journal if any.
+ */
+static void _send(MPROC *me, MIDIO_MSG *msg)
+{
+    if (me->journal)
+        mjournal_add(me->journal, MJOURNAL_OUT, msg, me->journal_time);
+    midio_send(me->midio, msg);
+}
+
+static void _stamp_journal(MPROC *me)
 {
+    if (me->journal)
+        me->journal_time = midio_get_time();
+}
+
+static void _note_event(void *ctx, int arg)
+{
+    MPROC *me = ctx;
     MIDIO_MSG msg = {
         .port = -1,
-        .size = 3,
-        .bytes = {0x90, note, 0x20},
+        .ump = { midio_ump_midi1(0x90, arg & 0x7F, arg >> 8) },
     };
-    midio_send(out, &msg);
-    usleep(10 * 1000);  // 0.1 s
-    msg.bytes[2] = 0x00;
-    midio_send(out, &msg);
+    _send(me, &msg);
+}
+
+static void _exit_event(void *ctx, int arg)
+{
+    MPROC *me = ctx;
+    midio_stop(me->midio, arg);
 }
 
-static void _scale(MIDIO *out)
+/**
+ * Schedule a short note starting at the given time and return the time
+ * it ends.
+ */
+static uint64_t _ding(MPROC *me, int note, uint64_t time)
+{
+    msched_add(&me->sched, time, _note_event, me, note | 0x20 << 8);
+    msched_add(&me->sched, time + DING_DURATION, _note_event, me, note);
+    return time + DING_DURATION;
+}
+
+static uint64_t _scale(MPROC *me, uint64_t time)
 {
     int i;
     for (i=0; i<12 ;i++) {
-        _ding(out, i + 0x3C);
+        time = _ding(me, i + 0x3C, time);
     }
+    return time;
 }
 
 //static void _send_note_off(MIDIO *out, int note)
@@ -50,16 +91,32 @@ static void _scale(MIDIO *out)
 //    midio_send(out, &msg);
 //}
 
-void mproc_init(MPROC *me, MIDIO *midio)
+static void _add_builtin_stages(MPROC *me);
+static void _compile_routes(MPROC *me);
+
+/**
+ * Initialize with the given rules, or the built-in ones if NULL.
+ */
+void mproc_init(MPROC *me, MIDIO *midio, const MRULES *rules)
 {
     memset(me, 0, sizeof(*me));
     me->midio = midio;
-    me->beatstep_port = midio_get_port_by_name(midio, "BeatStep");
-    if (me->beatstep_port == -1)
-        me->beatstep_port = midio_get_port_by_name(midio, "Arturia BeatStep");
+    msched_init(&me->sched);
+    memset(me->pad_color, PAD_COLOR_UNKNOWN, sizeof(me->pad_color));
+    if (rules)
+        me->rules = *rules;
+    else
+        mrules_init(&me->rules);
+    me->disconnect_count = midio_get_disconnect_count(midio);
+    _add_builtin_stages(me);
+
+    me->beatstep_port = -1;
+    for (int i = 0; i < me->rules.controller_count && me->beatstep_port == -1; i++)
+        me->beatstep_port = midio_get_port_by_name(midio, me->rules.controllers[i]);
     printf("BeatStep: port=%d\n", me->beatstep_port);
-    me->virtual_port = midio_get_port_by_name(midio, "Virtual Output");
+    me->virtual_port = me->rules.output[0] ? midio_get_port_by_name(midio, me->rules.output) : -1;
     printf("Virtual Output: port=%d\n", me->virtual_port);
+    _compile_routes(me);
 }
 
 int beatstep_get_pad_index(int note)
@@ -96,168 +153,719 @@ void beatstep_set_pad_color(MPROC *me, int pad_index, int color_index)
     midio_send_sysex(me->midio, me->beatstep_port, buf, sizeof(buf));
 }
 
+static void _led_event(void *ctx, int arg)
+{
+    MPROC *me = ctx;
+    (void)arg;
+
+    // send a limited number of pad colors, the oldest changes first
+    int sent = 0;
+    for (int i = 0; i < PAD_COUNT && sent < LED_MAX_PER_UPDATE; i++) {
+        if (me->pad_dirty & (1 << i)) {
+            beatstep_set_pad_color(me, i, me->pad_target[i]);
+            me->pad_color[i] = me->pad_target[i];
+            me->pad_dirty &= ~(1 << i);
+            sent++;
+        }
+    }
+
+    // come back later for the remaining ones
+    if (me->pad_dirty)
+        msched_add(&me->sched, midio_get_time() + LED_INTERVAL, _led_event, me, 0);
+    else
+        me->led_pending = false;
+}
+
+/**
+ * Request a pad color. Only pads whose color differs from the one
+ * displayed are sent, later and at a limited rate, by _led_event.
+ */
+static void _set_pad_target(MPROC *me, int pad_index, int color_index)
+{
+    me->pad_target[pad_index] = color_index;
+    if (me->pad_color[pad_index] != color_index)
+        me->pad_dirty |= 1 << pad_index;
+    else
+        me->pad_dirty &= ~(1 << pad_index);
+}
+
 void beatstep_update_ui(MPROC *me, int pad_index, bool down)
 {
+    if (pad_index < 0 || pad_index >= PAD_COUNT)
+        return;
+
     if (me->ui_mode == 0) {
-        int shifts[] = {
-            1000, 1000, 1000, 1000, -3, -8, -1, -6,
-            1, -4, 3, -2, 5, 0, 7, 2
-        };
-        if (shifts[pad_index] != 1000 && down) {
-            me->shift = shifts[pad_index] - 12;
+        const MRULES_RULE *pads = me->rules.pad;
+        if (pads[pad_index].action == MRULES_KEY && down) {
+            me->shift = pads[pad_index].arg - 12;
         }
         int key = 1000;
-        for (int i=0; i<sizeof(shifts); i++) {
-            if (shifts[i] == GMU_ASYM_MOD(me->shift, 12)) {
+        for (int i=0; i<PAD_COUNT; i++) {
+            if (pads[i].action == MRULES_KEY && pads[i].arg == GMU_ASYM_MOD(me->shift, 12)) {
                 key = i;
                 break;
             }
         }
-        for (int i=0; i<16; i++) {
+        for (int i=0; i<PAD_COUNT; i++) {
             if (i == pad_index && down) {
-                // do nothing
+                // the pad lights itself while pressed: its color is unknown
+                me->pad_color[i] = PAD_COLOR_UNKNOWN;
+                me->pad_dirty &= ~(1 << i);
             } else if (i == key) {
-                beatstep_set_pad_color(me, i, 0x10);
+                _set_pad_target(me, i, 0x10);
             } else {
-                beatstep_set_pad_color(me, i, 0);
+                _set_pad_target(me, i, 0);
             }
         }
     }
+
+    // LED traffic is sent off the note path
+    if (me->pad_dirty && !me->led_pending) {
+        me->led_pending = true;
+        msched_add(&me->sched, midio_get_time(), _led_event, me, 0);
+    }
 }
 
-void mproc_msg_handler(MPROC *me, MIDIO_MSG *msg_in)
+/**
+ * Record a note forwarded as fnote, or a new velocity if it is already
+ * sounding.
+ */
+static void _fwd_add(MPROC *me, int channel, int note, int vel, int fnote, int in_port, int out_port)
 {
-    MIDIO_MSG msg = *msg_in;
+    if (me->fwd_vel[channel][note] == 0) {
+        int index = channel * 128 + note;
+        me->fwd_active[index / 64] |= (uint64_t)1 << (index % 64);
+        me->fwd_count++;
+
+        // count the note in its pitch class
+        int pc = note % 12;
+        if (me->pc_count[pc]++ == 0)
+            me->chord |= 1 << pc;
+    }
+    me->fwd_vel[channel][note] = vel;
+    me->fwd_note[channel][note] = fnote;
+    me->fwd_in[channel][note] = in_port;
+    me->fwd_out[channel][note] = out_port;
+}
+
+/**
+ * Forget a forwarded note. fwd_note is kept: the output stage reads it
+ * to send the note off.
+ */
+static void _fwd_remove(MPROC *me, int channel, int note)
+{
+    int index = channel * 128 + note;
+    me->fwd_vel[channel][note] = 0;
+    me->fwd_active[index / 64] &= ~((uint64_t)1 << (index % 64));
+    me->fwd_count--;
+
+    int pc = note % 12;
+    if (--me->pc_count[pc] == 0)
+        me->chord &= ~(1 << pc);
+}
+
+static int _next_bit(const uint64_t *bits, int index)
+{
+    int word = index / 64;
+    if (word >= MPROC_NOTE_COUNT / 64)
+        return -1;
+
+    uint64_t w = bits[word] & (~(uint64_t)0 << (index % 64));
+    for (;;) {
+        if (w)
+            return word * 64 + __builtin_ctzll(w);
+        if (++word == MPROC_NOTE_COUNT / 64)
+            return -1;
+        w = bits[word];
+    }
+}
+
+/**
+ * Return the first sounding note whose index (channel * 128 + note) is
+ * index or above, -1 if none. The walk skips 64 silent notes per step.
+ */
+int mproc_next_active(const MPROC *me, int index)
+{
+    return _next_bit(me->fwd_active, index);
+}
 
-    // midio_print_msg(&msg);
-
-    int cmd;   // midi command
-    int channel;
-    int note;  // when cmd = 8 or 9
-    int vel;   // when cmd = 9
-    bool note_on;
-    bool note_off;
-    bool fwd = true;
-    int fnote; // forwarded (transposed) note
-
-    cmd = (msg.bytes[0] >> 4) & 0x0F;
-    channel = msg.bytes[0] & 0x0F;
-    note = msg.bytes[1] & 0x7F;
-    vel = msg.bytes[2];
-    note_on = ((cmd == 9) && (vel != 0));
-    note_off = ((cmd == 8) || ((cmd == 9) && (vel == 0)));
-
-    if (me->virtual_port >= 0 && msg.port == me->beatstep_port)
-        fwd = false;
-
-    // beatstep control
-    if (msg.port == me->beatstep_port) {
-        if (note_on || note_off) {
-            int pad_index = beatstep_get_pad_index(note);
-            beatstep_update_ui(me, pad_index, note_on);
+/**
+ * Port a message from the given input port is forwarded to, if the port
+ * has no zones.
+ */
+static int _out_port(MPROC *me, int in_port)
+{
+    if (me->virtual_port >= 0)
+        return me->virtual_port;
+    if (in_port == me->beatstep_port)
+        return -1;
+    return in_port;
+}
+
+/**
+ * Zones of the given input port, NULL if it has none. There are at most
+ * MPROC_MAX_ROUTED_PORTS of them.
+ */
+static const MPROC_ROUTING *_routing(const MPROC *me, int port)
+{
+    for (int i = 0; i < me->routing_count; i++) {
+        if (me->routings[i].port == port)
+            return &me->routings[i];
+    }
+    return NULL;
+}
+
+/**
+ * Store a fan-out list, or reuse the previous one if equal, as it is for
+ * all the keys of a zone. Lists that do not fit are left empty.
+ */
+static MPROC_ROUTE _add_route(MPROC *me, MPROC_ROUTE prev, const MPROC_DEST *dests, int count)
+{
+    if (count == 0)
+        return (MPROC_ROUTE){0, 0};
+    if (prev.count == count && !memcmp(&me->dests[prev.first], dests, count * sizeof(dests[0])))
+        return prev;
+    if (me->dest_count + count > MPROC_MAX_DESTS) {
+        printf("WARNING: too many zone destinations\n");
+        return (MPROC_ROUTE){0, 0};
+    }
+    MPROC_ROUTE route = {me->dest_count, count};
+    memcpy(&me->dests[me->dest_count], dests, count * sizeof(dests[0]));
+    me->dest_count += count;
+    return route;
+}
+
+static bool _zone_matches(const MRULES_ZONE *zone, int src, int channel)
+{
+    return zone->src == src && (zone->src_channel < 0 || zone->src_channel == channel);
+}
+
+/**
+ * Compile the zones into a routing per input port, so that the output
+ * stage finds the destinations of a message with a lookup. Port names
+ * are resolved once: a port plugged later is not routed.
+ */
+static void _compile_routes(MPROC *me)
+{
+    const MRULES *rules = &me->rules;
+    int ports[MRULES_MAX_PORTS];
+    for (int i = 0; i < rules->port_count; i++) {
+        ports[i] = midio_get_port_by_name(me->midio, rules->port_names[i]);
+        printf("%s: port=%d\n", rules->port_aliases[i], ports[i]);
+    }
+
+    for (int src = 0; src < rules->port_count; src++) {
+        bool used = false;
+        for (int z = 0; z < rules->zone_count; z++)
+            used |= rules->zones[z].src == src;
+        if (!used || ports[src] == -1 || _routing(me, ports[src]))
+            continue;
+        if (me->routing_count == MPROC_MAX_ROUTED_PORTS) {
+            printf("WARNING: too many ports with zones\n");
+            break;
+        }
+        MPROC_ROUTING *routing = &me->routings[me->routing_count++];
+        routing->port = ports[src];
+
+        for (int channel = 0; channel < MPROC_CHANNEL_COUNT; channel++) {
+            MPROC_DEST dests[MRULES_MAX_ZONES];
+            MPROC_ROUTE prev = {0, 0};
+            for (int note = 0; note < 128; note++) {
+                int count = 0;
+                for (int z = 0; z < rules->zone_count; z++) {
+                    const MRULES_ZONE *zone = &rules->zones[z];
+                    if (!_zone_matches(zone, src, channel) || note < zone->first || note > zone->last ||
+                        ports[zone->dst] == -1)
+                        continue;
+                    dests[count++] = (MPROC_DEST){
+                        .port = ports[zone->dst],
+                        .channel = zone->dst_channel < 0 ? channel : zone->dst_channel,
+                        .transpose = zone->transpose,
+                    };
+                }
+                prev = _add_route(me, prev, dests, count);
+                routing->notes[channel][note] = prev;
+            }
+
+            // other channel messages go to each port and channel once
+            int count = 0;
+            for (int z = 0; z < rules->zone_count; z++) {
+                const MRULES_ZONE *zone = &rules->zones[z];
+                if (!_zone_matches(zone, src, channel) || ports[zone->dst] == -1)
+                    continue;
+                MPROC_DEST dest = {
+                    .port = ports[zone->dst],
+                    .channel = zone->dst_channel < 0 ? channel : zone->dst_channel,
+                };
+                int i;
+                for (i = 0; i < count && (dests[i].port != dest.port || dests[i].channel != dest.channel); i++)
+                    ;
+                if (i == count)
+                    dests[count++] = dest;
+            }
+            routing->others[channel] = _add_route(me, prev, dests, count);
+        }
+    }
+    if (rules->zone_count > 0)
+        printf("zones: %d, routed ports: %d, destinations: %d\n", rules->zone_count, me->routing_count, me->dest_count);
+}
+
+/**
+ * Note offs already sent by a release, one bitset (channel * 128 + note)
+ * per output port.
+ */
+struct release {
+    int port_count;
+    int ports[RELEASE_MAX_PORTS];
+    uint64_t sent[RELEASE_MAX_PORTS][MPROC_NOTE_COUNT / 64];
+};
+
+/**
+ * Send a note off, unless the same one has already been sent. Past
+ * RELEASE_MAX_PORTS ports, duplicates are sent: they are harmless.
+ */
+static void _send_note_off(MPROC *me, struct release *release, int port, int channel, int note)
+{
+    int i;
+    for (i = 0; i < release->port_count && release->ports[i] != port; i++)
+        ;
+    if (i == release->port_count && i < RELEASE_MAX_PORTS) {
+        release->ports[i] = port;
+        memset(release->sent[i], 0, sizeof(release->sent[i]));
+        release->port_count++;
+    }
+    if (i < RELEASE_MAX_PORTS) {
+        int key = channel * 128 + note;
+        uint64_t bit = (uint64_t)1 << (key % 64);
+        if (release->sent[i][key / 64] & bit)
             return;
+        release->sent[i][key / 64] |= bit;
+    }
+
+    MIDIO_MSG msg = {
+        .port = port,
+        .ump = { midio_ump_midi1(0x80 | channel, note, 0) },
+    };
+    _send(me, &msg);
+}
+
+/**
+ * Fan-out list a routed note has been sent through.
+ */
+static MPROC_ROUTE _note_route(const MPROC *me, int channel, int note)
+{
+    return _routing(me, me->fwd_in[channel][note])->notes[channel][note];
+}
+
+/**
+ * Send a note off for each selected note, where selected is a copy of
+ * fwd_active restricted to the notes to release, and forget them. Notes
+ * sharing an output port, channel and sent note get a single note off.
+ * The cost is bounded: one walk of the 2048 bits.
+ */
+static void _release(MPROC *me, const uint64_t *selected)
+{
+    struct release release;
+    release.port_count = 0;
+
+    for (int index = _next_bit(selected, 0); index >= 0; index = _next_bit(selected, index + 1)) {
+        int channel = index / 128;
+        int note = index % 128;
+        int fnote = me->fwd_note[channel][note];
+        int out_port = me->fwd_out[channel][note];
+        if (out_port == MPROC_ROUTED) {
+            MPROC_ROUTE route = _note_route(me, channel, note);
+            for (int i = 0; i < route.count; i++) {
+                const MPROC_DEST *dest = &me->dests[route.first + i];
+                int n = fnote + dest->transpose;
+                if (n >= 0 && n < 128)
+                    _send_note_off(me, &release, dest->port, dest->channel, n);
+            }
+        } else {
+            _send_note_off(me, &release, out_port, channel, fnote);
         }
+        _fwd_remove(me, channel, note);
     }
+}
+
+/**
+ * Release every forwarded note. The note offs are queued, and sent by
+ * the next midio_flush with a single write per port.
+ */
+void mproc_panic(MPROC *me)
+{
+    uint64_t selected[MPROC_NOTE_COUNT / 64];
+    memcpy(selected, me->fwd_active, sizeof(selected));
+    _stamp_journal(me);
+    _release(me, selected);
+}
+
+static bool _is_out_lost(MPROC *me, int channel, int note)
+{
+    int out_port = me->fwd_out[channel][note];
+    if (out_port != MPROC_ROUTED)
+        return !midio_is_port_connected(me->midio, out_port);
+
+    MPROC_ROUTE route = _note_route(me, channel, note);
+    for (int i = 0; i < route.count; i++) {
+        if (!midio_is_port_connected(me->midio, me->dests[route.first + i].port))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Release the notes played by or sent to a device that is gone: their
+ * note off would never come, or would reach nothing.
+ */
+static void _check_devices(MPROC *me)
+{
+    uint32_t count = midio_get_disconnect_count(me->midio);
+    if (count == me->disconnect_count)
+        return;
+    me->disconnect_count = count;
+
+    uint64_t selected[MPROC_NOTE_COUNT / 64] = {0};
+    for (int index = mproc_next_active(me, 0); index >= 0; index = mproc_next_active(me, index + 1)) {
+        int channel = index / 128;
+        int note = index % 128;
+        if (!midio_is_port_connected(me->midio, me->fwd_in[channel][note]) || _is_out_lost(me, channel, note))
+            selected[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+    _release(me, selected);
+}
+
+/**
+ * BeatStep stage: pads drive the UI and are not forwarded.
+ */
+static bool _beatstep_stage(void *ctx, MIDIO_MSG *msg)
+{
+    MPROC *me = ctx;
+    int cmd = midio_msg_status(msg) >> 4;
+    if (msg->port == me->beatstep_port && (cmd == 8 || cmd == 9)) {
+        int pad_index = beatstep_get_pad_index(midio_msg_index(msg));
+        beatstep_update_ui(me, pad_index, midio_msg_is_note_on(msg));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Console stage: the left pedal, the panic controller, the transition
+ * chords and the notes played while the pedal is down, none of them
+ * forwarded.
+ */
+static bool _console_stage(void *ctx, MIDIO_MSG *msg)
+{
+    MPROC *me = ctx;
+
+    // MIDI 2.0 per-note and registered controllers have no rule
+    if (midio_msg_status(msg) < 0x80)
+        return true;
+
+    const MRULES_RULE *rule = mrules_get(&me->rules, midio_msg_status(msg), midio_msg_index(msg));
+    bool note_on = midio_msg_is_note_on(msg);
 
     // changement du pedale de gauche ?
-    if (cmd == 0xB && msg.bytes[1] == 0x43) {
-        fwd = false;
-        me->console = msg.bytes[2] != 0;
+    if (rule->action == MRULES_CONSOLE) {
+        me->console = midio_msg_value(msg) != 0;
         printf("console = %d\n", me->console);
         me->exit_count = 0;
         if (me->console) {
             // pedale da gauche de haut en bas
-            // update current chord
-            int i;
-            int chord = 0; // 12 bit chord before transposition
-            for (i=0; i<128; i++)
-                if (me->fwd_vel[i] != 0)
-                    chord |= 1 << (i % 12);
-            printf("chord = 0x%03x\n", chord);
-            if (chord == 0x122 || chord == 0x922) {
-                // accord de transition
-                me->shift += 2;
-                printf("shift = %d\n", me->shift);
-            } else if (chord == 0x092 || chord == 0x292 || chord == 0x212) {
-                // accord de transition
-                me->shift -= 2;
-                printf("shift = %d\n", me->shift);
-            } else if (chord == 0x910 || chord == 0x914) {
+            // current chord, 12 bit before transposition
+            printf("chord = 0x%03x\n", me->chord);
+            if (me->rules.chord_shift[me->chord]) {
                 // accord de transition
-                me->shift -= 7;
-                printf("shift = %d\n", me->shift);
-            } else if (chord == 0x452 || chord == 0x442) {
-                // accord de transition
-                me->shift += 7;
+                me->shift += me->rules.chord_shift[me->chord];
                 printf("shift = %d\n", me->shift);
             }
         } else {
             // pedale da gauche de bas en haut
         }
+        return false;
+    }
+
+    if (rule->action == MRULES_PANIC) {
+        if (midio_msg_value(msg) != 0)
+            mproc_panic(me);
+        return false;
     }
 
     // handle console commands
     if (me->console && note_on) {
         // note on avec pedale de gauche en bas
-        int rel_note = note - 60; // 0 = DO in the middle
-        if (rel_note > (-12) && rel_note < 12) {
-            me->shift = rel_note - 4;
+        if (rule->action == MRULES_SHIFT) {
+            me->shift = rule->arg;
             printf("shift = %d\n", me->shift);
         }
-        if (rel_note == -12) {
+        if (rule->action == MRULES_HALT && !me->exit_pending) {
             me->exit_count++;
-            if (me->exit_count >= 5) {
-                _scale(me->midio);
-                exit(2); // exit and halt
+            if (me->exit_count >= rule->arg) {
+                // exit and halt, once the scale has been played; the
+                // scale and the exit are scheduled once
+                uint64_t end = _scale(me, midio_get_time());
+                msched_add(&me->sched, end, _exit_event, me, 2);
+                me->exit_pending = true;
             }
         }
-        if (rel_note == -13) {
+        if (rule->action == MRULES_EXIT) {
             me->exit_count++;
-            if (me->exit_count >= 5) {
-                exit(3); // exit only
+            if (me->exit_count >= rule->arg) {
+                midio_stop(me->midio, 3); // exit only
             }
         }
+        return false;
     }
 
-    // transpose
-    if (note_on) {
-        if (me->console) {
-            fwd = false;
-        } else {
-            if (me->fwd_vel[note] != 0)
-                printf("WARNING: unexpected note on message\n");
-            fnote = (note + me->shift);
-            if (fnote < 0 || fnote >= 128) {
-                fwd = false;
-            } else {
-                me->fwd_vel[note] = vel;
-                me->fwd_note[note] = fnote;
-                msg.bytes[1] = fnote;
-            }
-        }
+    return true;
+}
+
+/**
+ * Velocity of a note on, scaled down to 7 bits as for a MIDI 1.0 device.
+ */
+static int _velocity(const MIDIO_MSG *msg)
+{
+    uint32_t vel = midio_msg_value(msg);
+    if (midio_msg_type(msg) == MIDIO_UMP_MIDI2)
+        vel = vel >> 9 ? vel >> 9 : 1;
+    return (int)vel;
+}
+
+/**
+ * Transposer stage: note ons take the current shift, note offs the shift
+ * their note on had. The note numbers are left untouched: the output
+ * stage applies the shift, plus the one of each zone. Notes out of range
+ * and note offs of notes never forwarded are dropped.
+ */
+static bool _transpose_stage(void *ctx, MIDIO_MSG *msg)
+{
+    MPROC *me = ctx;
+    int cmd = midio_msg_status(msg) >> 4;
+    int channel = midio_msg_channel(msg);
+    int note = midio_msg_index(msg);
+
+    if (midio_msg_is_note_on(msg)) {
+        if (me->fwd_vel[channel][note] != 0)
+            printf("WARNING: unexpected note on message\n");
+        int fnote = note + me->shift;
+        if (fnote < 0 || fnote >= 128)
+            return false;
+        int out_port = _routing(me, msg->port) ? MPROC_ROUTED : _out_port(me, msg->port);
+        _fwd_add(me, channel, note, _velocity(msg), fnote, msg->port, out_port);
+    } else if (cmd == 8 || cmd == 9) {
+        if (me->fwd_vel[channel][note] == 0)
+            return false;
+        _fwd_remove(me, channel, note);
     }
-    if (note_off) {
-        if (me->fwd_vel[note] == 0) {
-            fwd = false;
-        } else {
-            fnote = me->fwd_note[note];
-            me->fwd_vel[note] = 0;
-            msg.bytes[1] = fnote;
+    return true;
+}
+
+/**
+ * Send a copy of the message to each destination of route, on its
+ * channel. Note messages are sent as fnote plus the zone transposition,
+ * or not at all if out of range.
+ */
+static void _send_routed(MPROC *me, const MIDIO_MSG *msg, MPROC_ROUTE route, int fnote)
+{
+    for (int i = 0; i < route.count; i++) {
+        const MPROC_DEST *dest = &me->dests[route.first + i];
+        MIDIO_MSG out = *msg;
+        out.port = dest->port;
+        midio_msg_set_channel(&out, dest->channel);
+        if (fnote >= 0) {
+            int note = fnote + dest->transpose;
+            if (note < 0 || note >= 128)
+                continue;
+            midio_msg_set_index(&out, note);
         }
+        _send(me, &out);
     }
+}
 
-    // forward
-    if (fwd) {
-        if (me->virtual_port >= 0) {
-            msg.port = me->virtual_port;
-        } else {
-            if (msg.port == me->beatstep_port)
-                msg.port = -1;
+/**
+ * Output stage: send what is left. Messages of a port with zones go to
+ * the destinations of their key, or of their channel if they are not
+ * note or poly pressure messages; the others go to _out_port. Poly
+ * pressure of a key not sounding is dropped. Messages from the BeatStep
+ * only go out when there is no virtual output.
+ */
+static bool _forward_stage(void *ctx, MIDIO_MSG *msg)
+{
+    MPROC *me = ctx;
+
+    if (me->virtual_port >= 0 && msg->port == me->beatstep_port)
+        return false;
+    int cmd = midio_msg_status(msg) >> 4;
+    int channel = midio_msg_channel(msg);
+    int note = midio_msg_index(msg);
+
+    // transposed note, kept by _fwd_remove for the note offs; poly
+    // pressure follows the note it applies to, if it is sounding
+    int fnote = -1;
+    if (cmd == 8 || cmd == 9) {
+        fnote = me->fwd_note[channel][note];
+    } else if (cmd == 0xA) {
+        if (me->fwd_vel[channel][note] == 0)
+            return false;
+        fnote = me->fwd_note[channel][note];
+    }
+
+    const MPROC_ROUTING *routing = cmd != 0x0F ? _routing(me, msg->port) : NULL;
+    if (routing) {
+        _send_routed(me, msg, fnote >= 0 ? routing->notes[channel][note] : routing->others[channel], fnote);
+        return true;
+    }
+
+    msg->port = _out_port(me, msg->port);
+    if (fnote >= 0)
+        midio_msg_set_index(msg, fnote);
+
+    // send midi command out
+    _send(me, msg);
+    return true;
+}
+
+static bool _insert_stage(MPROC *me, int index, const char *name, bool (* process)(void *ctx, MIDIO_MSG *msg), void *ctx)
+{
+    if (me->stage_count == MPROC_MAX_STAGES)
+        return false;
+
+    memmove(&me->stages[index + 1], &me->stages[index], (me->stage_count - index) * sizeof(me->stages[0]));
+    me->stage_count++;
+    MPROC_STAGE *stage = &me->stages[index];
+    memset(stage, 0, sizeof(*stage));
+    stage->name = name;
+    stage->process = process;
+    stage->ctx = ctx;
+    return true;
+}
+
+/**
+ * Add a stage to the pipeline, after the console and the stages added
+ * before, and before the transposer. A stage processes one message in
+ * place: it may rewrite it, note included, and returns false to drop
+ * it. It may also pass more messages to the stages following it, see
+ * mproc_emit. Return false if the pipeline is full.
+ */
+bool mproc_add_stage(MPROC *me, const char *name, bool (* process)(void *ctx, MIDIO_MSG *msg), void *ctx)
+{
+    return _insert_stage(me, me->stage_count - 2, name, process, ctx);
+}
+
+static void _add_builtin_stages(MPROC *me)
+{
+    _insert_stage(me, me->stage_count, "beatstep", _beatstep_stage, me);
+    _insert_stage(me, me->stage_count, "console", _console_stage, me);
+    _insert_stage(me, me->stage_count, "transpose", _transpose_stage, me);
+    _insert_stage(me, me->stage_count, "forward", _forward_stage, me);
+}
+
+/**
+ * Run a message through the stages from first on, timing each one if
+ * stage_timing is set, the messages it emits included.
+ */
+static void _run_stages(MPROC *me, MIDIO_MSG *msg, int first)
+{
+    for (int i = first; i < me->stage_count; i++) {
+        MPROC_STAGE *stage = &me->stages[i];
+        me->stage_index = i;
+        if (!me->stage_timing) {
+            if (!stage->process(stage->ctx, msg))
+                return;
+            continue;
+        }
+
+        uint64_t start = midio_get_time();
+        bool pass = stage->process(stage->ctx, msg);
+        uint64_t end = midio_get_time();
+
+        // read by the thread reporting the profile
+        __atomic_store_n(&stage->time, stage->time + (end - start), __ATOMIC_RELAXED);
+        __atomic_store_n(&stage->msg_count, stage->msg_count + 1, __ATOMIC_RELAXED);
+        if (!pass) {
+            __atomic_store_n(&stage->drop_count, stage->drop_count + 1, __ATOMIC_RELAXED);
+            return;
         }
+    }
+}
 
-        // send midi command out
-        midio_send(me->midio, &msg);
+/**
+ * From a stage, pass one more message to the stages following it, e.g.
+ * a harmony note. It goes through them before the message the stage is
+ * processing.
+ */
+void mproc_emit(MPROC *me, const MIDIO_MSG *msg)
+{
+    int index = me->stage_index;
+    MIDIO_MSG copy = *msg;
+    _run_stages(me, &copy, index + 1);
+    me->stage_index = index;
+}
 
-        // midio_print_msg(&msg);
+/**
+ * Record the batch in the journal, if any, and run it through the
+ * stages. The messages go through all the stages one at a time, since a
+ * message may change the state in which the next ones are processed,
+ * e.g. the transposition of a note off followed by a note on of the
+ * same key. The batch is modified in place.
+ */
+static void _run_pipeline(MPROC *me, MIDIO_MSG *msgs, int count)
+{
+    if (me->journal) {
+        for (int i = 0; i < count; i++)
+            mjournal_add(me->journal, MJOURNAL_IN, &msgs[i], me->journal_time);
     }
+    for (int i = 0; i < count; i++)
+        _run_stages(me, &msgs[i], 0);
+}
+
+void mproc_msg_handler(MPROC *me, MIDIO_MSG *msg_in)
+{
+    MIDIO_MSG msg = *msg_in;
+    mproc_batch_handler(me, &msg, 1);
+}
+
+/**
+ * Process a batch of messages, possibly empty, after releasing the notes
+ * of lost devices and running the scheduled events that are due. The
+ * messages are modified in place by the stages.
+ */
+void mproc_batch_handler(MPROC *me, MIDIO_MSG *msgs, int count)
+{
+    _stamp_journal(me);
+    _check_devices(me);
+
+    uint64_t next_time = msched_get_next_time(&me->sched);
+    if (next_time) {
+        uint64_t now = midio_get_time();
+        if (next_time <= now)
+            msched_run(&me->sched, now);
+    }
+
+    _run_pipeline(me, msgs, count);
+}
+
+/**
+ * Return the time at which mproc_batch_handler and midio_flush must be
+ * called again, even if no message is received, or 0 if none.
+ */
+uint64_t mproc_get_next_time(MPROC *me)
+{
+    uint64_t event_time = msched_get_next_time(&me->sched);
+
+    // sounding notes must be released soon after their device is lost,
+    // even if nothing else happens
+    if (me->fwd_count > 0) {
+        uint64_t check_time = midio_get_time() + DEVICE_CHECK_INTERVAL;
+        if (event_time == 0 || check_time < event_time)
+            event_time = check_time;
+    }
+    uint64_t send_time = midio_get_next_send_time(me->midio);
+
+    if (event_time == 0)
+        return send_time;
+    if (send_time == 0)
+        return event_time;
+    return event_time < send_time ? event_time : send_time;
 }
@@ -9,10 +9,67 @@
 #define _MPROC_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "midio.h"
+#include "mjournal.h"
+#include "msched.h"
+#include "mrules.h"
+
+
+#define MPROC_CHANNEL_COUNT 16
+#define MPROC_NOTE_COUNT    (MPROC_CHANNEL_COUNT * 128)   // index: channel * 128 + note
+#define MPROC_MAX_STAGES    16
+#define MPROC_MAX_ROUTED_PORTS  4       // input ports having zones
+#define MPROC_MAX_DESTS     4096        // fan-out list entries, shared by keys
+#define MPROC_ROUTED        (-2)        // fwd_out of a note sent through zones
 
 
 typedef struct mproc MPROC;
+typedef struct mproc_stage MPROC_STAGE;
+typedef struct mproc_dest MPROC_DEST;
+typedef struct mproc_route MPROC_ROUTE;
+typedef struct mproc_routing MPROC_ROUTING;
+
+/**
+ * Processing step, see mproc_add_stage. The counters are updated only
+ * when stage timing is enabled.
+ */
+struct mproc_stage {
+    const char *name;
+    bool (* process)(void *ctx, MIDIO_MSG *msg);
+    void *ctx;
+    uint64_t time;          // ns spent in process
+    uint64_t msg_count;     // messages received
+    uint64_t drop_count;    // messages not passed to the next stage
+};
+
+/**
+ * Where a routed message goes. Note messages are transposed by the
+ * shift, then by transpose.
+ */
+struct mproc_dest {
+    int16_t port;
+    uint8_t channel;
+    int8_t transpose;
+};
+
+/**
+ * Fan-out list: count entries of dests starting at first.
+ */
+struct mproc_route {
+    uint16_t first;
+    uint16_t count;
+};
+
+/**
+ * Zones of an input port, compiled into a fan-out list per channel and
+ * key, and per channel for the other channel messages.
+ */
+struct mproc_routing {
+    int port;
+    MPROC_ROUTE notes[MPROC_CHANNEL_COUNT][128];
+    MPROC_ROUTE others[MPROC_CHANNEL_COUNT];
+};
 
 struct mproc {
     MIDIO *midio;
@@ -21,31 +78,108 @@ struct mproc {
     bool console;
     int shift;
     int exit_count;
+    bool exit_pending;      // halt scheduled, see MRULES_HALT
     int beatstep_port;
     int virtual_port;
 
     /**
      * Array containing the state of the forwarded notes, i.e. the state of
      * notes as seen by the synthetiser connected to the output.
-     * The array index is the untransposed note.
+     * The array index is the channel, then the untransposed note.
      * The array content is the note velocity.
      * A null velocity means that the note is off.
      */
-    char fwd_vel[128];
+    char fwd_vel[MPROC_CHANNEL_COUNT][128];
 
     /**
      * Array containing the state of the forwarded notes, i.e. the state of
      * notes as seen by the synthetiser connected to the output.
-     * The array index is the untransposed note.
+     * The array index is the channel, then the untransposed note.
      * The array content is the transposed note as it has been sent to
-     * the synthetiser.
+     * the synthetiser, before the transposition of its zones if routed.
+     */
+    char fwd_note[MPROC_CHANNEL_COUNT][128];
+
+    /**
+     * Bit channel * 128 + note is set when fwd_vel[channel][note] is not
+     * null, so that the sounding notes are found without a full scan,
+     * see mproc_next_active.
+     */
+    uint64_t fwd_active[MPROC_NOTE_COUNT / 64];
+    int fwd_count;
+
+    /**
+     * Ports a forwarded note came from and went to, so that its note off
+     * can be sent when one of them disappears, see mproc_panic.
+     */
+    int16_t fwd_in[MPROC_CHANNEL_COUNT][128];
+    int16_t fwd_out[MPROC_CHANNEL_COUNT][128];
+    uint32_t disconnect_count;
+
+    /**
+     * Number of forwarded notes per pitch class (untransposed, all
+     * channels), kept up to date with fwd_vel. Bit i of chord is set when pc_count[i] is not 0.
+     */
+    uint8_t pc_count[12];
+    uint16_t chord;
+
+    /**
+     * Behavior, see mrules.h.
+     */
+    MRULES rules;
+
+    /**
+     * Pipeline run on each message: BeatStep UI, console, the stages
+     * added with mproc_add_stage, transposer, then output. stage_index
+     * is the stage running.
+     */
+    MPROC_STAGE stages[MPROC_MAX_STAGES];
+    int stage_count;
+    int stage_index;
+    bool stage_timing;
+
+    /**
+     * Split and layer zones, compiled when mproc starts. Input ports
+     * without zones are forwarded as a whole, see _out_port.
+     */
+    MPROC_ROUTING routings[MPROC_MAX_ROUTED_PORTS];
+    int routing_count;
+    MPROC_DEST dests[MPROC_MAX_DESTS];
+    int dest_count;
+
+    /**
+     * Delayed actions, such as note offs of generated notes, run from
+     * mproc_batch_handler instead of sleeping in the handler.
+     */
+    MSCHED sched;
+
+    /**
+     * BeatStep pad colors: pad_color is the color displayed by the device
+     * (0xFF if unknown), pad_target the color wanted. Bits of pad_dirty
+     * mark the pads whose color must be sent.
+     */
+    uint8_t pad_color[16];
+    uint8_t pad_target[16];
+    uint16_t pad_dirty;
+    bool led_pending;
+
+    /**
+     * If set, every message received and sent is recorded there, those
+     * sent now at journal_time, read once per batch.
      */
-    char fwd_note[128];
+    MJOURNAL *journal;
+    uint64_t journal_time;
 };
 
 
-void mproc_init(MPROC *me, MIDIO *midio);
+void mproc_init(MPROC *me, MIDIO *midio, const MRULES *rules);
 void mproc_msg_handler(MPROC *me, MIDIO_MSG *msg_in);
+void mproc_batch_handler(MPROC *me, MIDIO_MSG *msgs, int count);
+uint64_t mproc_get_next_time(MPROC *me);
+int mproc_next_active(const MPROC *me, int index);
+void mproc_panic(MPROC *me);
+bool mproc_add_stage(MPROC *me, const char *name, bool (* process)(void *ctx, MIDIO_MSG *msg), void *ctx);
+void mproc_emit(MPROC *me, const MIDIO_MSG *msg);
 
 
 #endif
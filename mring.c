@@ -0,0 +1,333 @@
+//
+//  mring.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef LINUX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include "mring.h"
+
+
+/*** literals ***/
+
+#define SPIN_COUNT  1000    // polls before sleeping in MRING_WAIT_BLOCK mode
+
+
+/*** types ***/
+
+struct mring_cond {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+
+/*** functions ***/
+
+/**
+ * Sleep until woken up by the producer or until deadline (0 = forever).
+ */
+static void _sleep(MRING *me, uint64_t deadline)
+{
+    struct timespec timeout;
+
+    if (deadline) {
+        uint64_t now = midio_get_time();
+        if (now >= deadline)
+            return;
+        uint64_t delay = deadline - now;
+        timeout.tv_sec = (time_t)(delay / 1000000000);
+        timeout.tv_nsec = (long)(delay % 1000000000);
+    }
+
+#ifdef LINUX
+    syscall(SYS_futex, &me->waiting, FUTEX_WAIT_PRIVATE, 1, deadline ? &timeout : NULL, NULL, 0);
+#else
+    struct mring_cond *cond = me->cond;
+    struct timespec abs_timeout;
+    if (deadline) {
+        clock_gettime(CLOCK_REALTIME, &abs_timeout);
+        abs_timeout.tv_sec += timeout.tv_sec;
+        abs_timeout.tv_nsec += timeout.tv_nsec;
+        if (abs_timeout.tv_nsec >= 1000000000) {
+            abs_timeout.tv_sec++;
+            abs_timeout.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&cond->mutex);
+    while (__atomic_load_n(&me->waiting, __ATOMIC_SEQ_CST)) {
+        if (!deadline) {
+            pthread_cond_wait(&cond->cond, &cond->mutex);
+        } else if (pthread_cond_timedwait(&cond->cond, &cond->mutex, &abs_timeout) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cond->mutex);
+#endif
+}
+
+static void _wake(MRING *me)
+{
+#ifdef LINUX
+    syscall(SYS_futex, &me->waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    struct mring_cond *cond = me->cond;
+    pthread_mutex_lock(&cond->mutex);
+    pthread_cond_signal(&cond->cond);
+    pthread_mutex_unlock(&cond->mutex);
+#endif
+}
+
+/**
+ * Create a ring able to hold size messages. size is rounded up to a power
+ * of two.
+ */
+MRING *mring_create(int size, enum mring_wait wait)
+{
+    MRING *me = NULL;
+    int rounded = 1;
+
+    while (rounded < size)
+        rounded <<= 1;
+
+    if (posix_memalign((void **)&me, MRING_CACHE_LINE, sizeof(*me)) != 0)
+        return NULL;
+    memset(me, 0, sizeof(*me));
+    me->size = rounded;
+    me->mask = rounded - 1;
+    me->wait = wait;
+    me->entries = calloc(rounded, sizeof(*me->entries));
+
+    struct mring_cond *cond = calloc(1, sizeof(*cond));
+    pthread_mutex_init(&cond->mutex, NULL);
+    pthread_cond_init(&cond->cond, NULL);
+    me->cond = cond;
+
+    return me;
+}
+
+/**
+ * Create a ring taking pushes from several threads at once, see
+ * mring_create.
+ */
+MRING *mring_create_mpsc(int size, enum mring_wait wait)
+{
+    MRING *me = mring_create(size, wait);
+    if (me)
+        me->seqs = calloc(me->size, sizeof(*me->seqs));
+    return me;
+}
+
+void mring_destroy(MRING *me)
+{
+    struct mring_cond *cond = me->cond;
+    pthread_mutex_destroy(&cond->mutex);
+    pthread_cond_destroy(&cond->cond);
+    free(cond);
+    free(me->seqs);
+    free(me->entries);
+    free(me);
+}
+
+static void _copy_entries(MRING *me, uint32_t head, const MIDIO_MSG *msgs, int count)
+{
+    uint64_t now = 0;
+    for (int i = 0; i < count; i++) {
+        MIDIO_MSG *entry = &me->entries[(head + i) & me->mask];
+        *entry = msgs[i];
+        if (entry->time == 0) {
+            if (now == 0)
+                now = midio_get_time();
+            entry->time = now;
+        }
+    }
+}
+
+/**
+ * mring_push_batch for a ring created by mring_create_mpsc. The counters
+ * are shared by the producers, hence updated with atomic operations.
+ */
+static int _push_mpsc(MRING *me, const MIDIO_MSG *msgs, int count)
+{
+    // reserve n slots, as many as free up to count
+    uint32_t head = __atomic_load_n(&me->prod.head, __ATOMIC_RELAXED);
+    uint32_t tail;
+    int n;
+    do {
+        tail = __atomic_load_n(&me->cons.tail, __ATOMIC_ACQUIRE);
+        uint32_t free_count = me->size - (head - tail);
+        n = count < (int)free_count ? count : (int)free_count;
+    } while (n > 0 && !__atomic_compare_exchange_n(&me->prod.head, &head, head + n, true,
+                                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    // fill and publish them; the consumer takes them in order
+    _copy_entries(me, head, msgs, n);
+    for (int i = 0; i < n; i++)
+        __atomic_store_n(&me->seqs[(head + i) & me->mask], head + i + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (me->wait == MRING_WAIT_BLOCK && __atomic_load_n(&me->waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&me->waiting, 0, __ATOMIC_SEQ_CST);
+        _wake(me);
+        __atomic_fetch_add(&me->prod.wake_count, 1, __ATOMIC_RELAXED);
+    }
+
+    int depth = (int)(head + n - tail);
+    int max_depth = __atomic_load_n(&me->prod.max_depth, __ATOMIC_RELAXED);
+    while (depth > max_depth && !__atomic_compare_exchange_n(&me->prod.max_depth, &max_depth, depth, true,
+                                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_fetch_add(&me->prod.push_count, n, __ATOMIC_RELAXED);
+    if (n < count)
+        __atomic_fetch_add(&me->prod.overrun_count, count - n, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/**
+ * Producer side: append messages. Messages without a time are stamped
+ * with the current time. Messages that do not fit are dropped and counted
+ * as overruns.
+ * Return the number of messages appended.
+ */
+int mring_push_batch(MRING *me, const MIDIO_MSG *msgs, int count)
+{
+    if (me->seqs)
+        return _push_mpsc(me, msgs, count);
+
+    uint32_t head = me->prod.head;
+    uint32_t free_count = me->size - (head - me->prod.tail_cache);
+
+    if (free_count < (uint32_t)count) {
+        me->prod.tail_cache = __atomic_load_n(&me->cons.tail, __ATOMIC_ACQUIRE);
+        free_count = me->size - (head - me->prod.tail_cache);
+    }
+
+    int n = count < (int)free_count ? count : (int)free_count;
+    _copy_entries(me, head, msgs, n);
+
+    // publish, then check whether the consumer is sleeping
+    __atomic_store_n(&me->prod.head, head + n, __ATOMIC_SEQ_CST);
+    if (me->wait == MRING_WAIT_BLOCK && __atomic_load_n(&me->waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&me->waiting, 0, __ATOMIC_SEQ_CST);
+        _wake(me);
+        __atomic_store_n(&me->prod.wake_count, me->prod.wake_count + 1, __ATOMIC_RELAXED);
+    }
+
+    int depth = (int)(head + n - me->prod.tail_cache);
+    if (depth > me->prod.max_depth)
+        __atomic_store_n(&me->prod.max_depth, depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&me->prod.push_count, me->prod.push_count + n, __ATOMIC_RELAXED);
+    if (n < count)
+        __atomic_store_n(&me->prod.overrun_count, me->prod.overrun_count + (count - n), __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/**
+ * Tell the consumer that nothing more will be pushed, by any producer.
+ * Once the ring is drained, mring_pop_batch returns -1.
+ */
+void mring_close(MRING *me)
+{
+    __atomic_store_n(&me->prod.closed, true, __ATOMIC_SEQ_CST);
+    if (me->wait == MRING_WAIT_BLOCK && __atomic_load_n(&me->waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&me->waiting, 0, __ATOMIC_SEQ_CST);
+        _wake(me);
+    }
+}
+
+/**
+ * Return the number of messages that can be taken, up to max_count with
+ * several producers, where slots are published out of order.
+ */
+static int _available(MRING *me, int max_count)
+{
+    uint32_t tail = me->cons.tail;
+
+    if (me->seqs) {
+        int n = 0;
+        while (n < max_count && __atomic_load_n(&me->seqs[(tail + n) & me->mask], __ATOMIC_ACQUIRE) == tail + n + 1)
+            n++;
+        return n;
+    }
+
+    if (me->cons.head_cache == tail)
+        me->cons.head_cache = __atomic_load_n(&me->prod.head, __ATOMIC_ACQUIRE);
+    return (int)(me->cons.head_cache - tail);
+}
+
+/**
+ * Consumer side: wait until at least one message is available, according
+ * to the wait strategy, or until deadline (0 = forever), then take up to
+ * max_count messages. Return the number of messages stored in msgs,
+ * 0 if the deadline has been reached, or -1 if the ring is closed and
+ * drained.
+ */
+int mring_pop_batch(MRING *me, MIDIO_MSG *msgs, int max_count, uint64_t deadline)
+{
+    int available;
+    int spins = 0;
+
+    for (;;) {
+        available = _available(me, max_count);
+        if (available > 0)
+            break;
+        if (__atomic_load_n(&me->prod.closed, __ATOMIC_SEQ_CST))
+            return -1;
+        if (deadline && midio_get_time() >= deadline)
+            return 0;
+
+        switch (me->wait) {
+            case MRING_WAIT_SPIN:
+                break;
+            case MRING_WAIT_YIELD:
+                sched_yield();
+                break;
+            case MRING_WAIT_BLOCK:
+                if (++spins < SPIN_COUNT)
+                    break;
+                spins = 0;
+                // announce the sleep, then check again to not miss a push
+                __atomic_store_n(&me->waiting, 1, __ATOMIC_SEQ_CST);
+                me->cons.head_cache = __atomic_load_n(&me->prod.head, __ATOMIC_SEQ_CST);
+                if (me->cons.head_cache != me->cons.tail || __atomic_load_n(&me->prod.closed, __ATOMIC_SEQ_CST)) {
+                    __atomic_store_n(&me->waiting, 0, __ATOMIC_SEQ_CST);
+                    break;
+                }
+                _sleep(me, deadline);
+                __atomic_store_n(&me->waiting, 0, __ATOMIC_SEQ_CST);
+                break;
+        }
+    }
+
+    int n = available < max_count ? available : max_count;
+    uint32_t tail = me->cons.tail;
+    for (int i = 0; i < n; i++)
+        msgs[i] = me->entries[(tail + i) & me->mask];
+    __atomic_store_n(&me->cons.tail, tail + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/**
+ * Return the producer counters. May be called from any thread.
+ */
+void mring_get_stats(MRING *me, MRING_STATS *stats)
+{
+    stats->push_count = __atomic_load_n(&me->prod.push_count, __ATOMIC_RELAXED);
+    stats->overrun_count = __atomic_load_n(&me->prod.overrun_count, __ATOMIC_RELAXED);
+    stats->wake_count = __atomic_load_n(&me->prod.wake_count, __ATOMIC_RELAXED);
+    stats->max_depth = __atomic_load_n(&me->prod.max_depth, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,92 @@
+//
+//  mring.h
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#ifndef _MRING_H_
+#define _MRING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "midio.h"
+
+
+/*** literals ***/
+
+#define MRING_CACHE_LINE    64
+
+
+/*** types ***/
+
+typedef struct mring MRING;
+typedef struct mring_stats MRING_STATS;
+
+enum mring_wait {
+    MRING_WAIT_SPIN,    // busy loop, lowest latency, burns a core
+    MRING_WAIT_YIELD,   // busy loop calling sched_yield
+    MRING_WAIT_BLOCK,   // spin briefly, then sleep on a futex (Linux) or a condition
+};
+
+struct mring_stats {
+    uint64_t push_count;     // messages accepted
+    uint64_t overrun_count;  // messages dropped because the ring was full
+    uint64_t wake_count;     // times the consumer had to be woken up
+    int max_depth;           // highest number of messages seen in the ring
+};
+
+/**
+ * Single-consumer ring of timestamped messages.
+ * Producer and consumer indexes live on distinct cache lines, each side
+ * keeping a private copy of the other side index to limit cache line
+ * transfers to one per batch.
+ * A ring created by mring_create_mpsc takes pushes from several threads:
+ * producers reserve slots by moving head with a compare and swap, and
+ * publish each slot by writing its sequence number, which the consumer
+ * waits for instead of head.
+ */
+struct mring {
+    // constant part
+    int size;           // power of two
+    int mask;
+    enum mring_wait wait;
+    MIDIO_MSG *entries;
+    uint32_t *seqs;     // MPSC only: slot i holds position p once seqs[i] == p + 1
+
+    // producer part
+    struct {
+        uint32_t head;          // next slot to write
+        uint32_t tail_cache;    // last known consumer position
+        uint64_t push_count;
+        uint64_t overrun_count;
+        uint64_t wake_count;
+        int max_depth;
+        bool closed;            // no more pushes will come
+    } __attribute__((aligned(MRING_CACHE_LINE))) prod;
+
+    // consumer part
+    struct {
+        uint32_t tail;          // next slot to read
+        uint32_t head_cache;    // last known producer position
+    } __attribute__((aligned(MRING_CACHE_LINE))) cons;
+
+    // consumer sleeping flag, also used as futex word
+    uint32_t waiting __attribute__((aligned(MRING_CACHE_LINE)));
+    void *cond;     // condition used when futexes are not available
+};
+
+
+/*** prototypes ***/
+
+MRING *mring_create(int size, enum mring_wait wait);
+MRING *mring_create_mpsc(int size, enum mring_wait wait);
+void mring_destroy(MRING *me);
+int mring_push_batch(MRING *me, const MIDIO_MSG *msgs, int count);
+void mring_close(MRING *me);
+int mring_pop_batch(MRING *me, MIDIO_MSG *msgs, int max_count, uint64_t deadline);
+void mring_get_stats(MRING *me, MRING_STATS *stats);
+
+
+#endif
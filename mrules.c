@@ -0,0 +1,352 @@
+//
+//  mrules.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+//  Rule files are made of lines, '#' starting a comment:
+//
+//    controller NAME           port whose pads drive the UI, may be repeated
+//    output NAME               port receiving the forwarded messages
+//    pedal NAME                input device whose keys are sent as controllers
+//                              0x43, 0x42..., taken from the system (Linux)
+//    cc N console              console mode while controller N is not 0
+//    cc N panic                release all sounding notes when N is not 0
+//    note N[-M] shift S        console: note N sets the shift to S, N+1 to S+1...
+//    note N halt|exit COUNT    console: stop after COUNT presses
+//    chord MASK shift S        console pressed with this chord: shift += S
+//    pad N key K               BeatStep pad N selects key K
+//    port ALIAS NAME           name a port for zones
+//    zone SRC [ch C] N-M to DST [ch C] [transpose T]
+//                              send notes N to M of port SRC, channel C or
+//                              all, to port DST, channel C or the same;
+//                              a port with zones sends nothing else
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "mrules.h"
+
+
+/*** literals ***/
+
+#define MAX_LINE    256
+
+
+/*** globals ***/
+
+// rules used when no file is given, same as miditrick.rules
+static const char *_default_rules[] = {
+    "controller BeatStep",
+    "controller Arturia BeatStep",
+    "output Virtual Output",
+    "cc 0x43 console",
+    "note 49-71 shift -15",
+    "note 48 halt 5",
+    "note 47 exit 5",
+    "chord 0x122 shift 2",
+    "chord 0x922 shift 2",
+    "chord 0x092 shift -2",
+    "chord 0x292 shift -2",
+    "chord 0x212 shift -2",
+    "chord 0x910 shift -7",
+    "chord 0x914 shift -7",
+    "chord 0x452 shift 7",
+    "chord 0x442 shift 7",
+    "pad 4 key -3",
+    "pad 5 key -8",
+    "pad 6 key -1",
+    "pad 7 key -6",
+    "pad 8 key 1",
+    "pad 9 key -4",
+    "pad 10 key 3",
+    "pad 11 key -2",
+    "pad 12 key 5",
+    "pad 13 key 0",
+    "pad 14 key 7",
+    "pad 15 key 2",
+};
+
+
+/*** functions ***/
+
+static char *_trim(char *s)
+{
+    while (isspace((unsigned char)*s))
+        s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        end--;
+    *end = 0;
+    return s;
+}
+
+static bool _parse_int(const char *s, int min, int max, int *value)
+{
+    char *end;
+    if (!s)
+        return false;
+    long v = strtol(s, &end, 0);
+    if (end == s || *end || v < min || v > max)
+        return false;
+    *value = (int)v;
+    return true;
+}
+
+/**
+ * Parse "N" or "N-M" into a range of notes or controllers.
+ */
+static bool _parse_range(const char *s, int *first, int *last)
+{
+    char *end;
+    if (!s)
+        return false;
+    *first = (int)strtol(s, &end, 0);
+    if (end == s)
+        return false;
+    *last = *first;
+    if (*end == '-') {
+        const char *s2 = end + 1;
+        *last = (int)strtol(s2, &end, 0);
+        if (end == s2)
+            return false;
+    }
+    return !*end && *first >= 0 && *first <= *last && *last <= 127;
+}
+
+static bool _parse_name(char *dst, char *rest)
+{
+    if (!rest)
+        return false;
+    rest = _trim(rest);
+    if (!*rest || strlen(rest) >= MRULES_MAX_NAME)
+        return false;
+    strcpy(dst, rest);
+    return true;
+}
+
+static int _find_port(MRULES *me, const char *alias)
+{
+    for (int i = 0; i < me->port_count; i++) {
+        if (!strcmp(me->port_aliases[i], alias))
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Parse "[ch C]" at the current token, with C from 1 to 16, or -1 if
+ * absent. Return the token following it.
+ */
+static char *_parse_channel(char *token, char **save, int *channel, bool *ok)
+{
+    *channel = -1;
+    if (!token || strcmp(token, "ch"))
+        return token;
+    int value = 1;
+    if (!_parse_int(strtok_r(NULL, " \t", save), 1, 16, &value))
+        *ok = false;
+    *channel = value - 1;
+    return strtok_r(NULL, " \t", save);
+}
+
+static bool _parse_zone(MRULES *me, char **save)
+{
+    if (me->zone_count == MRULES_MAX_ZONES)
+        return false;
+
+    MRULES_ZONE zone = {0};
+    bool ok = true;
+    int channel, first, last, value;
+
+    char *token = strtok_r(NULL, " \t", save);
+    int src = token ? _find_port(me, token) : -1;
+    token = _parse_channel(strtok_r(NULL, " \t", save), save, &channel, &ok);
+    zone.src_channel = channel;
+    if (src == -1 || !_parse_range(token, &first, &last))
+        return false;
+    token = strtok_r(NULL, " \t", save);
+    if (!token || strcmp(token, "to"))
+        return false;
+    token = strtok_r(NULL, " \t", save);
+    int dst = token ? _find_port(me, token) : -1;
+    token = _parse_channel(strtok_r(NULL, " \t", save), save, &channel, &ok);
+    zone.dst_channel = channel;
+    if (dst == -1 || !ok)
+        return false;
+    if (token && !strcmp(token, "transpose")) {
+        if (!_parse_int(strtok_r(NULL, " \t", save), -127, 127, &value))
+            return false;
+        zone.transpose = value;
+        token = strtok_r(NULL, " \t", save);
+    }
+    if (token)
+        return false;
+
+    zone.src = src;
+    zone.first = first;
+    zone.last = last;
+    zone.dst = dst;
+    me->zones[me->zone_count++] = zone;
+    return true;
+}
+
+static MRULES_RULE *_rule(MRULES *me, uint8_t status, int n)
+{
+    return &me->msg[(status >> 4) & 0x07][n];
+}
+
+/**
+ * Parse one line, already stripped of its comment. Return false if it is
+ * not valid.
+ */
+static bool _parse_line(MRULES *me, char *line)
+{
+    char *save;
+    char *keyword = strtok_r(line, " \t", &save);
+    if (!keyword)
+        return true;
+
+    if (!strcmp(keyword, "controller")) {
+        if (me->controller_count == MRULES_MAX_CONTROLLERS)
+            return false;
+        return _parse_name(me->controllers[me->controller_count++], strtok_r(NULL, "", &save));
+    }
+    if (!strcmp(keyword, "output"))
+        return _parse_name(me->output, strtok_r(NULL, "", &save));
+    if (!strcmp(keyword, "pedal")) {
+        if (me->pedal_count == MRULES_MAX_PEDALS)
+            return false;
+        return _parse_name(me->pedals[me->pedal_count++], strtok_r(NULL, "", &save));
+    }
+    if (!strcmp(keyword, "port")) {
+        char *alias = strtok_r(NULL, " \t", &save);
+        if (!alias || strlen(alias) >= MRULES_MAX_NAME || _find_port(me, alias) != -1 ||
+            me->port_count == MRULES_MAX_PORTS)
+            return false;
+        strcpy(me->port_aliases[me->port_count], alias);
+        return _parse_name(me->port_names[me->port_count++], strtok_r(NULL, "", &save));
+    }
+    if (!strcmp(keyword, "zone"))
+        return _parse_zone(me, &save);
+
+    char *key = strtok_r(NULL, " \t", &save);
+    char *action = strtok_r(NULL, " \t", &save);
+    char *arg = strtok_r(NULL, " \t", &save);
+    if (!action || strtok_r(NULL, " \t", &save))
+        return false;
+    int first, last, n, value;
+
+    if (!strcmp(keyword, "cc")) {
+        if (!_parse_range(key, &first, &last) || arg)
+            return false;
+        if (!strcmp(action, "console"))
+            value = MRULES_CONSOLE;
+        else if (!strcmp(action, "panic"))
+            value = MRULES_PANIC;
+        else
+            return false;
+        for (n = first; n <= last; n++)
+            *_rule(me, 0xB0, n) = (MRULES_RULE){ value, 0 };
+        return true;
+    }
+
+    if (!strcmp(keyword, "note")) {
+        if (!_parse_range(key, &first, &last))
+            return false;
+        if (!strcmp(action, "shift")) {
+            if (!_parse_int(arg, -127, 127 - (last - first), &value))
+                return false;
+            for (n = first; n <= last; n++)
+                *_rule(me, 0x90, n) = (MRULES_RULE){ MRULES_SHIFT, value + n - first };
+        } else if (!strcmp(action, "halt") || !strcmp(action, "exit")) {
+            if (!_parse_int(arg, 1, 127, &value))
+                return false;
+            for (n = first; n <= last; n++)
+                *_rule(me, 0x90, n) = (MRULES_RULE){ action[0] == 'h' ? MRULES_HALT : MRULES_EXIT, value };
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    if (!strcmp(keyword, "chord")) {
+        if (!_parse_int(key, 1, MRULES_CHORD_COUNT - 1, &n) || strcmp(action, "shift") ||
+            !_parse_int(arg, -127, 127, &value) || value == 0)
+            return false;
+        me->chord_shift[n] = value;
+        return true;
+    }
+
+    if (!strcmp(keyword, "pad")) {
+        if (!_parse_int(key, 0, MRULES_PAD_COUNT - 1, &n) || strcmp(action, "key") ||
+            !_parse_int(arg, -115, 127, &value))
+            return false;
+        me->pad[n] = (MRULES_RULE){ MRULES_KEY, value };
+        return true;
+    }
+
+    return false;
+}
+
+static bool _parse(MRULES *me, const char *text, const char *path, int line_nb)
+{
+    char line[MAX_LINE];
+    if (strlen(text) >= sizeof(line)) {
+        printf("mrules: %s:%d: line too long\n", path, line_nb);
+        return false;
+    }
+    strcpy(line, text);
+    char *comment = strchr(line, '#');
+    if (comment)
+        *comment = 0;
+    if (!_parse_line(me, line)) {
+        printf("mrules: %s:%d: invalid rule: %s\n", path, line_nb, text);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Set the built-in rules.
+ */
+void mrules_init(MRULES *me)
+{
+    memset(me, 0, sizeof(*me));
+    for (size_t i = 0; i < sizeof(_default_rules) / sizeof(_default_rules[0]); i++) {
+        if (!_parse(me, _default_rules[i], "built-in", (int)i + 1))
+            abort();
+    }
+}
+
+/**
+ * Replace the rules with those of the given file. Errors are reported
+ * with their line number. Return 0 on success, -1 on error.
+ */
+int mrules_load(MRULES *me, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("mrules: cannot open %s\n", path);
+        return -1;
+    }
+
+    memset(me, 0, sizeof(*me));
+    char line[MAX_LINE + 1];
+    int line_nb = 0;
+    int result = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_nb++;
+        // a line not ending within the buffer is too long, see _parse
+        line[strcspn(line, "\r\n")] = 0;
+        if (!_parse(me, line, path, line_nb)) {
+            result = -1;
+            break;
+        }
+    }
+    fclose(file);
+    return result;
+}
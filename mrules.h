@@ -0,0 +1,99 @@
+//
+//  mrules.h
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#ifndef _MRULES_H_
+#define _MRULES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*** literals ***/
+
+#define MRULES_MAX_NAME         64
+#define MRULES_MAX_CONTROLLERS  4
+#define MRULES_MAX_PEDALS       4
+#define MRULES_PAD_COUNT        16
+#define MRULES_CHORD_COUNT      4096    // 12-bit pitch class masks
+#define MRULES_MAX_PORTS        8       // port aliases used by zones
+#define MRULES_MAX_ZONES        64
+
+
+/*** types ***/
+
+typedef struct mrules MRULES;
+typedef struct mrules_rule MRULES_RULE;
+typedef struct mrules_zone MRULES_ZONE;
+
+enum mrules_action {
+    MRULES_NONE,
+    MRULES_CONSOLE,     // control change: console mode while the value is not 0
+    MRULES_SHIFT,       // console note on, chord: set or change the shift by arg
+    MRULES_HALT,        // console note on, arg times: play a scale and stop with code 2
+    MRULES_EXIT,        // console note on, arg times: stop with code 3
+    MRULES_KEY,         // pad: select key arg, i.e. a shift of arg - 12
+    MRULES_PANIC,       // control change not 0: release all sounding notes
+};
+
+struct mrules_rule {
+    uint8_t action;     // enum mrules_action
+    int8_t arg;
+};
+
+/**
+ * Notes of a keyboard range, on one or all channels, sent to a port.
+ * Zones overlapping on a key are layered.
+ */
+struct mrules_zone {
+    uint8_t src;            // index in ports
+    int8_t src_channel;     // 0 to 15, -1 for all
+    uint8_t first;          // notes
+    uint8_t last;
+    uint8_t dst;            // index in ports
+    int8_t dst_channel;     // 0 to 15, -1 to keep the channel
+    int8_t transpose;       // added to the shift
+};
+
+/**
+ * Behavior of mproc, loaded once into flat tables so that a message is
+ * dispatched with a couple of loads: by status (0x8n to 0xFn), then by
+ * note or controller number.
+ */
+struct mrules {
+    // ports, looked up by name when mproc starts
+    char controllers[MRULES_MAX_CONTROLLERS][MRULES_MAX_NAME];  // the first one found
+    int controller_count;
+    char output[MRULES_MAX_NAME];
+    char pedals[MRULES_MAX_PEDALS][MRULES_MAX_NAME];   // input devices, Linux only
+    int pedal_count;
+
+    // port aliases for zones: alias, then port name
+    char port_aliases[MRULES_MAX_PORTS][MRULES_MAX_NAME];
+    char port_names[MRULES_MAX_PORTS][MRULES_MAX_NAME];
+    int port_count;
+    MRULES_ZONE zones[MRULES_MAX_ZONES];
+    int zone_count;
+
+    MRULES_RULE msg[8][128];
+    MRULES_RULE pad[MRULES_PAD_COUNT];
+    int8_t chord_shift[MRULES_CHORD_COUNT];     // 0 if the chord is not a gesture
+};
+
+
+/*** prototypes ***/
+
+void mrules_init(MRULES *me);
+int mrules_load(MRULES *me, const char *path);
+
+static inline const MRULES_RULE *mrules_get(const MRULES *me, uint8_t status, uint8_t data)
+{
+    return &me->msg[(status >> 4) & 0x07][data & 0x7F];
+}
+
+
+#endif
@@ -0,0 +1,97 @@
+//
+//  msched.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "msched.h"
+
+
+/*** functions ***/
+
+static bool _before(const MSCHED_EVENT *a, const MSCHED_EVENT *b)
+{
+    return a->time < b->time || (a->time == b->time && (int32_t)(a->seq - b->seq) < 0);
+}
+
+void msched_init(MSCHED *me)
+{
+    memset(me, 0, sizeof(*me));
+}
+
+/**
+ * Schedule handler(ctx, arg) to be called at the given time. Events due
+ * at the same time are run in the order they were added. Return false if
+ * the scheduler is full.
+ */
+bool msched_add(MSCHED *me, uint64_t time, void (* handler)(void *ctx, int arg), void *ctx, int arg)
+{
+    if (me->count >= MSCHED_MAX_EVENTS) {
+        printf("msched: too many events\n");
+        return false;
+    }
+
+    MSCHED_EVENT event = {
+        .time = time,
+        .seq = me->seq++,
+        .handler = handler,
+        .ctx = ctx,
+        .arg = arg,
+    };
+
+    // sift up
+    int i = me->count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!_before(&event, &me->events[parent]))
+            break;
+        me->events[i] = me->events[parent];
+        i = parent;
+    }
+    me->events[i] = event;
+    return true;
+}
+
+static void _remove_first(MSCHED *me)
+{
+    MSCHED_EVENT last = me->events[--me->count];
+
+    // sift down
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= me->count)
+            break;
+        if (child + 1 < me->count && _before(&me->events[child + 1], &me->events[child]))
+            child++;
+        if (!_before(&me->events[child], &last))
+            break;
+        me->events[i] = me->events[child];
+        i = child;
+    }
+    me->events[i] = last;
+}
+
+/**
+ * Run all events due at the given time. Handlers may schedule new events.
+ */
+void msched_run(MSCHED *me, uint64_t now)
+{
+    while (me->count > 0 && me->events[0].time <= now) {
+        MSCHED_EVENT event = me->events[0];
+        _remove_first(me);
+        event.handler(event.ctx, event.arg);
+    }
+}
+
+/**
+ * Return the time of the next event, or 0 if none.
+ */
+uint64_t msched_get_next_time(MSCHED *me)
+{
+    return me->count > 0 ? me->events[0].time : 0;
+}
@@ -0,0 +1,54 @@
+//
+//  msched.h
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+
+#ifndef _MSCHED_H_
+#define _MSCHED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*** literals ***/
+
+#define MSCHED_MAX_EVENTS   256
+
+
+/*** types ***/
+
+typedef struct msched MSCHED;
+typedef struct msched_event MSCHED_EVENT;
+
+struct msched_event {
+    uint64_t time;  // monotonic time in ns, see midio_get_time
+    uint32_t seq;   // insertion order, to run simultaneous events in order
+    void (* handler)(void *ctx, int arg);
+    void *ctx;
+    int arg;
+};
+
+/**
+ * Event scheduler: a min-heap of timed callbacks, never allocating.
+ * It does not wait by itself: the owner runs the due events with
+ * msched_run and asks the pump to wake it up at msched_get_next_time.
+ */
+struct msched {
+    uint32_t seq;
+    int count;
+    MSCHED_EVENT events[MSCHED_MAX_EVENTS];
+};
+
+
+/*** prototypes ***/
+
+void msched_init(MSCHED *me);
+bool msched_add(MSCHED *me, uint64_t time, void (* handler)(void *ctx, int arg), void *ctx, int arg);
+void msched_run(MSCHED *me, uint64_t now);
+uint64_t msched_get_next_time(MSCHED *me);
+
+
+#endif
@@ -0,0 +1,261 @@
+//
+//  test_mproc.c
+//  miditrick
+//
+//  Copyright (c) 2021 Gabriele Mondada.
+//  Distributed under the terms of the MIT License.
+//
+//  Regression tests of the processing pipeline, run against the null
+//  MIDIO sink of the benchmarks. The messages sent are read back from a
+//  journal, see mjournal.h. Exit status is the number of tests failed.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../midio.h"
+#include "../mproc.h"
+
+
+/*** literals ***/
+
+#define JOURNAL_SIZE    256
+#define PORT_KEYBOARD   0
+
+
+/*** types ***/
+
+struct test {
+    MIDIO *midio;
+    MPROC mproc;
+    char journal_path[32];
+};
+
+
+/*** functions ***/
+
+static void _set(MIDIO_MSG *msg, int port, int b0, int b1, int b2)
+{
+    msg->time = 0;
+    msg->port = port;
+    msg->ump[0] = midio_ump_midi1(b0, b1, b2);
+    msg->ump[1] = 0;
+}
+
+static bool _start(struct test *me)
+{
+    strcpy(me->journal_path, "/tmp/miditrick-test-XXXXXX");
+    int fd = mkstemp(me->journal_path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return false;
+    }
+    close(fd);
+
+    me->midio = midio_create();
+    mproc_init(&me->mproc, me->midio, NULL);
+    me->mproc.journal = mjournal_create(me->journal_path, JOURNAL_SIZE);
+    if (!me->mproc.journal) {
+        unlink(me->journal_path);
+        midio_destroy(me->midio);
+        return false;
+    }
+    return true;
+}
+
+static void _stop(struct test *me)
+{
+    mjournal_destroy(me->mproc.journal);
+    unlink(me->journal_path);
+    midio_destroy(me->midio);
+}
+
+/**
+ * Compare the messages sent, in order, with the expected MIDI 1.0 bytes.
+ */
+static bool _check_sent(struct test *me, const uint8_t (*expected)[3], size_t expected_count)
+{
+    const MJOURNAL *journal = me->mproc.journal;
+    size_t count = 0;
+    bool ok = true;
+
+    for (uint64_t pos = 0; pos < journal->header->head; pos++) {
+        const MJOURNAL_EVENT *event = &journal->events[pos & journal->mask];
+        if (event->dir != MJOURNAL_OUT)
+            continue;
+        MIDIO_MSG msg = { .port = event->port, .ump = { event->ump[0], event->ump[1] } };
+        uint8_t bytes[3];
+        if (count >= expected_count || midio_msg_to_bytes(&msg, bytes) != 3 || memcmp(bytes, expected[count], 3)) {
+            fprintf(stderr, "  message %zu sent: %08X\n", count, msg.ump[0]);
+            ok = false;
+        }
+        count++;
+    }
+    if (count != expected_count) {
+        fprintf(stderr, "  %zu messages sent, %zu expected\n", count, expected_count);
+        ok = false;
+    }
+    return ok;
+}
+
+/**
+ * A note off and a note on of the same key in one batch, after a
+ * transposition change, must release the note that was sent, not the
+ * transposed one.
+ */
+static bool _test_same_key_batch(void)
+{
+    static const uint8_t expected[][3] = {
+        {0x90, 0x3C, 0x64},
+        {0x80, 0x3C, 0x00},
+        {0x90, 0x3E, 0x64},
+    };
+    struct test test;
+    MIDIO_MSG batch[2];
+
+    if (!_start(&test))
+        return false;
+    _set(&batch[0], PORT_KEYBOARD, 0x90, 0x3C, 0x64);
+    mproc_batch_handler(&test.mproc, batch, 1);
+    test.mproc.shift = 2;
+    _set(&batch[0], PORT_KEYBOARD, 0x80, 0x3C, 0x00);
+    _set(&batch[1], PORT_KEYBOARD, 0x90, 0x3C, 0x64);
+    mproc_batch_handler(&test.mproc, batch, 2);
+
+    bool ok = _check_sent(&test, expected, sizeof(expected) / sizeof(expected[0]));
+    _stop(&test);
+    return ok;
+}
+
+static bool _drop_note_60(void *ctx, MIDIO_MSG *msg)
+{
+    (void)ctx;
+    return !(midio_msg_is_note_on(msg) && midio_msg_index(msg) == 60);
+}
+
+static bool _add_third(void *ctx, MIDIO_MSG *msg)
+{
+    int cmd = midio_msg_status(msg) >> 4;
+    if (cmd == 8 || cmd == 9) {
+        MIDIO_MSG third = *msg;
+        midio_msg_set_index(&third, midio_msg_index(msg) + 4);
+        mproc_emit(ctx, &third);
+    }
+    return true;
+}
+
+/**
+ * A note on dropped by an added stage must leave no note sounding, and
+ * the notes an added stage emits must be sent and released.
+ */
+static bool _test_added_stages(void)
+{
+    static const uint8_t expected[][3] = {
+        {0x90, 0x42, 0x64},
+        {0x90, 0x3E, 0x64},
+        {0x80, 0x42, 0x00},
+        {0x80, 0x3E, 0x00},
+    };
+    struct test test;
+    MIDIO_MSG batch[4];
+
+    if (!_start(&test))
+        return false;
+    mproc_add_stage(&test.mproc, "drop", _drop_note_60, NULL);
+    mproc_add_stage(&test.mproc, "third", _add_third, &test.mproc);
+    _set(&batch[0], PORT_KEYBOARD, 0x90, 60, 0x64);
+    _set(&batch[1], PORT_KEYBOARD, 0x90, 62, 0x64);
+    _set(&batch[2], PORT_KEYBOARD, 0x80, 62, 0x00);
+    _set(&batch[3], PORT_KEYBOARD, 0x80, 60, 0x00);
+    mproc_batch_handler(&test.mproc, batch, 4);
+
+    bool ok = _check_sent(&test, expected, sizeof(expected) / sizeof(expected[0]));
+    if (test.mproc.fwd_count != 0) {
+        fprintf(stderr, "  %d notes left sounding\n", test.mproc.fwd_count);
+        ok = false;
+    }
+    _stop(&test);
+    return ok;
+}
+
+/**
+ * Poly pressure must follow the note it applies to, transposed as the
+ * note was, and be dropped for a key not sounding.
+ */
+static bool _test_poly_pressure(void)
+{
+    static const uint8_t expected[][3] = {
+        {0x90, 0x3E, 0x64},
+        {0xA0, 0x3E, 0x40},
+        {0x80, 0x3E, 0x00},
+    };
+    struct test test;
+    MIDIO_MSG batch[4];
+
+    if (!_start(&test))
+        return false;
+    test.mproc.shift = 2;
+    _set(&batch[0], PORT_KEYBOARD, 0x90, 0x3C, 0x64);
+    _set(&batch[1], PORT_KEYBOARD, 0xA0, 0x3C, 0x40);
+    _set(&batch[2], PORT_KEYBOARD, 0xA0, 0x3D, 0x40);
+    _set(&batch[3], PORT_KEYBOARD, 0x80, 0x3C, 0x00);
+    mproc_batch_handler(&test.mproc, batch, 4);
+
+    bool ok = _check_sent(&test, expected, sizeof(expected) / sizeof(expected[0]));
+    _stop(&test);
+    return ok;
+}
+
+/**
+ * With the default rules, pressing the halt key more than the count
+ * needed must schedule the closing scale and the exit only once.
+ */
+static bool _test_halt_once(void)
+{
+    struct test test;
+    MIDIO_MSG batch[2];
+
+    if (!_start(&test))
+        return false;
+    _set(&batch[0], PORT_KEYBOARD, 0xB0, 0x43, 0x7F);
+    mproc_batch_handler(&test.mproc, batch, 1);
+
+    int counts[8];
+    for (int i = 0; i < 8; i++) {
+        _set(&batch[0], PORT_KEYBOARD, 0x90, 48, 0x64);
+        _set(&batch[1], PORT_KEYBOARD, 0x80, 48, 0x00);
+        mproc_batch_handler(&test.mproc, batch, 2);
+        counts[i] = test.mproc.sched.count;
+    }
+
+    // scheduled by the fifth press, then only run as they are due
+    bool ok = counts[4] > counts[3] && counts[7] <= counts[4];
+    if (!ok)
+        fprintf(stderr, "  events scheduled: %d after 4 presses, %d after 5, %d after 8\n", counts[3], counts[4], counts[7]);
+    _stop(&test);
+    return ok;
+}
+
+int main(void)
+{
+    static const struct {
+        const char *name;
+        bool (* run)(void);
+    } tests[] = {
+        {"same key batch", _test_same_key_batch},
+        {"added stages",   _test_added_stages},
+        {"poly pressure",  _test_poly_pressure},
+        {"halt once",      _test_halt_once},
+    };
+    int fail_count = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool ok = tests[i].run();
+        fflush(stdout);
+        fprintf(stderr, "%s: %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        if (!ok)
+            fail_count++;
+    }
+    return fail_count;
+}